@@ -0,0 +1,276 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Micro-benchmark for the pattern comparison kernel.
+ *
+ * Tiles from the given sheets are converted to 32-byte bitplane patterns,
+ * and then compared using:
+ *  - The previous RGBA comparison, eight 32-byte memcmp calls per tile
+ *  - A single 32-byte memcmp call on the pattern
+ *  - sneptile_pattern_equal
+ *
+ * Equal comparisons are what the pool sees after a hash match,
+ * unequal comparisons are what it sees on a hash collision.
+ *
+ * Build and run from the top-level directory:
+ *   gcc -std=c11 -O1 -I libraries/libspng-0.7.4 -I source benchmark/pattern_compare.c \
+ *       libraries/libspng-0.7.4/spng.c -lm -lz -o pattern_compare_bench
+ *   ./pattern_compare_bench tiles.png [more_tiles.png..]
+ *
+ * Add -mavx2 to benchmark the AVX2 kernel.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <spng.h>
+
+#include "sneptile.h"
+#include "pattern_compare.h"
+
+#define ROUNDS 64
+
+typedef struct bench_tile_s {
+    pixel_t *rgba;
+    uint32_t stride;
+    uint8_t pattern [PATTERN_KEY_SIZE];
+    uint8_t pattern_copy [PATTERN_KEY_SIZE];
+} bench_tile_t;
+
+static bench_tile_t *tiles = NULL;
+static uint32_t tile_count = 0;
+
+/* Prevent the comparisons from being optimised out */
+static volatile uint32_t sink = 0;
+
+
+/*
+ * Return the current time in nanoseconds.
+ */
+static uint64_t bench_time_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Convert a tile to a bitplane pattern, using a first-seen palette of SMS colours.
+ */
+static void bench_tile_to_pattern (pixel_t *buffer, uint32_t stride, uint8_t *pattern)
+{
+    static uint8_t palette [64];
+    static uint32_t palette_size = 0;
+
+    memset (pattern, 0, PATTERN_KEY_SIZE);
+
+    for (uint32_t y = 0; y < 8; y++)
+    {
+        for (uint32_t x = 0; x < 8; x++)
+        {
+            pixel_t p = buffer [x + y * stride];
+            uint8_t index = 0;
+
+            if (p.a != 0)
+            {
+                uint8_t colour = ((p.r & 0xc0) >> 6) | ((p.g & 0xc0) >> 4) | ((p.b & 0xc0) >> 2);
+
+                for (index = 0; index < palette_size; index++)
+                {
+                    if (palette [index] == colour)
+                    {
+                        break;
+                    }
+                }
+                if (index == palette_size)
+                {
+                    palette [palette_size++] = colour;
+                }
+                index &= 0x0f;
+            }
+
+            for (uint32_t i = 0; i < 4; i++)
+            {
+                if (index & (1 << i))
+                {
+                    pattern [y * 4 + i] |= (1 << (7 - x));
+                }
+            }
+        }
+    }
+}
+
+
+/*
+ * Load the tiles from a .png file.
+ */
+static int bench_load_file (const char *name)
+{
+    spng_ctx *spng_context = spng_ctx_new (0);
+    struct spng_ihdr header = { };
+    size_t image_size = 0;
+    FILE *png_file = fopen (name, "rb");
+
+    if (png_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s.\n", name);
+        return RC_ERROR;
+    }
+
+    spng_set_png_file (spng_context, png_file);
+    if (spng_get_ihdr (spng_context, &header) != 0 ||
+        spng_decoded_image_size (spng_context, SPNG_FMT_RGBA8, &image_size) != 0)
+    {
+        fprintf (stderr, "Error: Failed to read %s.\n", name);
+        return RC_ERROR;
+    }
+
+    pixel_t *image = malloc (image_size);
+    if (image == NULL || spng_decode_image (spng_context, image, image_size, SPNG_FMT_RGBA8, SPNG_DECODE_TRNS) != 0)
+    {
+        fprintf (stderr, "Error: Failed to decode %s.\n", name);
+        return RC_ERROR;
+    }
+    spng_ctx_free (spng_context);
+    fclose (png_file);
+
+    uint32_t new_tiles = (header.width / 8) * (header.height / 8);
+    tiles = realloc (tiles, (tile_count + new_tiles) * sizeof (bench_tile_t));
+    if (tiles == NULL)
+    {
+        fprintf (stderr, "Error: Failed to allocate tiles.\n");
+        return RC_ERROR;
+    }
+
+    for (uint32_t row = 0; row + 8 <= header.height; row += 8)
+    {
+        for (uint32_t col = 0; col + 8 <= header.width; col += 8)
+        {
+            bench_tile_t *tile = &tiles [tile_count++];
+            tile->rgba = &image [row * header.width + col];
+            tile->stride = header.width;
+            bench_tile_to_pattern (tile->rgba, tile->stride, tile->pattern);
+            memcpy (tile->pattern_copy, tile->pattern, PATTERN_KEY_SIZE);
+        }
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * The previous comparison, on 8x8 RGBA tiles.
+ */
+static bool bench_rgba_equal (bench_tile_t *a, bench_tile_t *b)
+{
+    for (uint32_t row = 0; row < 8; row++)
+    {
+        if (memcmp (&a->rgba [row * a->stride], &b->rgba [row * b->stride], sizeof (pixel_t) * 8) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * Comparison on patterns using memcmp.
+ */
+static bool bench_memcmp_equal (const uint8_t *a, const uint8_t *b)
+{
+    return memcmp (a, b, PATTERN_KEY_SIZE) == 0;
+}
+
+
+/*
+ * Time one comparison method.
+ * If equal is set, each tile is compared against itself, otherwise against its neighbour.
+ */
+static double bench_run (int method, bool equal)
+{
+    uint64_t start = bench_time_ns ();
+    uint32_t matches = 0;
+
+    for (uint32_t round = 0; round < ROUNDS; round++)
+    {
+        for (uint32_t i = 0; i < tile_count; i++)
+        {
+            bench_tile_t *a = &tiles [i];
+            bench_tile_t *b = &tiles [equal ? i : (i + 1 + round) % tile_count];
+            const uint8_t *b_pattern = equal ? a->pattern_copy : b->pattern;
+
+            switch (method)
+            {
+                case 0:
+                    matches += bench_rgba_equal (a, b);
+                    break;
+                case 1:
+                    matches += bench_memcmp_equal (a->pattern, b_pattern);
+                    break;
+                default:
+                    matches += sneptile_pattern_equal (a->pattern, b_pattern);
+                    break;
+            }
+        }
+    }
+
+    sink += matches;
+    return (double) (bench_time_ns () - start) / ((double) ROUNDS * tile_count);
+}
+
+
+/*
+ * Entry point.
+ */
+int main (int argc, char **argv)
+{
+    static const char *method_names [3] = { "rgba memcmp x8", "pattern memcmp", "sneptile_pattern_equal" };
+
+    if (argc < 2)
+    {
+        fprintf (stderr, "Usage: %s tiles.png [more_tiles.png..]\n", argv [0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (bench_load_file (argv [i]) != RC_OK)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (tile_count < 2)
+    {
+        fprintf (stderr, "Error: At least two tiles are needed.\n");
+        return EXIT_FAILURE;
+    }
+
+#if defined (__AVX2__)
+    printf ("Kernel: AVX2\n");
+#elif defined (__SSE2__)
+    printf ("Kernel: SSE2\n");
+#else
+    printf ("Kernel: scalar\n");
+#endif
+    printf ("Tiles: %u, %u rounds\n\n", tile_count, ROUNDS);
+    printf ("%-24s %12s %12s\n", "Method", "Equal (ns)", "Unequal (ns)");
+
+    for (int method = 0; method < 3; method++)
+    {
+        double equal_ns = bench_run (method, true);
+        double unequal_ns = bench_run (method, false);
+        printf ("%-24s %12.2f %12.2f\n", method_names [method], equal_ns, unequal_ns);
+    }
+
+    return EXIT_SUCCESS;
+}
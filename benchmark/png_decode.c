@@ -0,0 +1,196 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Benchmark for the --trusted-input decode mode.
+ *
+ * Each sheet is read into memory once, and then decoded repeatedly:
+ *  - With the default checks, verifying the chunk CRCs and the zlib Adler-32
+ *  - As --trusted-input does, with SPNG_CTX_IGNORE_ADLER32 and SPNG_CRC_USE
+ *
+ * Build and run from the top-level directory:
+ *   gcc -std=c11 -O1 -I libraries/libspng-0.7.4 -I source benchmark/png_decode.c \
+ *       libraries/libspng-0.7.4/spng.c -lm -lz -o png_decode_bench
+ *   ./png_decode_bench tiles.png [more_tiles.png..]
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <spng.h>
+
+#include "sneptile.h"
+
+#define ROUNDS 32
+
+typedef struct bench_file_s {
+    uint8_t *data;
+    size_t size;
+    uint8_t *image;
+    size_t image_size;
+    enum spng_format format;
+} bench_file_t;
+
+static bench_file_t *files = NULL;
+static uint32_t file_count = 0;
+static size_t total_size = 0;
+
+
+/*
+ * Return the current time in nanoseconds.
+ */
+static uint64_t bench_time_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Decode a file from memory, optionally skipping the checksums.
+ */
+static int bench_decode (bench_file_t *file, bool trusted)
+{
+    spng_ctx *spng_context = spng_ctx_new (trusted ? SPNG_CTX_IGNORE_ADLER32 : 0);
+    int rc = RC_OK;
+
+    if (spng_context == NULL)
+    {
+        return RC_ERROR;
+    }
+
+    if ((trusted && spng_set_crc_action (spng_context, SPNG_CRC_USE, SPNG_CRC_USE) != 0) ||
+        spng_set_png_buffer (spng_context, file->data, file->size) != 0 ||
+        spng_decode_image (spng_context, file->image, file->image_size, file->format,
+                           file->format == SPNG_FMT_PNG ? 0 : SPNG_DECODE_TRNS) != 0)
+    {
+        rc = RC_ERROR;
+    }
+
+    spng_ctx_free (spng_context);
+    return rc;
+}
+
+
+/*
+ * Read a .png file into memory.
+ */
+static int bench_load_file (const char *name)
+{
+    FILE *png_file = fopen (name, "rb");
+    if (png_file == NULL)
+    {
+        fprintf (stderr, "Error: Unable to open %s.\n", name);
+        return RC_ERROR;
+    }
+
+    files = realloc (files, (file_count + 1) * sizeof (bench_file_t));
+    if (files == NULL)
+    {
+        fprintf (stderr, "Error: Failed to allocate files.\n");
+        return RC_ERROR;
+    }
+    bench_file_t *file = &files [file_count++];
+    memset (file, 0, sizeof (bench_file_t));
+
+    fseek (png_file, 0, SEEK_END);
+    file->size = ftell (png_file);
+    fseek (png_file, 0, SEEK_SET);
+
+    file->data = malloc (file->size);
+    if (file->data == NULL || fread (file->data, 1, file->size, png_file) != file->size)
+    {
+        fprintf (stderr, "Error: Failed to read %s.\n", name);
+        return RC_ERROR;
+    }
+    fclose (png_file);
+
+    /* Decode as Sneptile does, palette images are kept as indices */
+    spng_ctx *spng_context = spng_ctx_new (0);
+    struct spng_ihdr header = { };
+
+    if (spng_context == NULL || spng_set_png_buffer (spng_context, file->data, file->size) != 0 ||
+        spng_get_ihdr (spng_context, &header) != 0)
+    {
+        fprintf (stderr, "Error: Failed to read %s.\n", name);
+        return RC_ERROR;
+    }
+    file->format = (header.color_type == SPNG_COLOR_TYPE_INDEXED) ? SPNG_FMT_PNG : SPNG_FMT_RGBA8;
+
+    if (spng_decoded_image_size (spng_context, file->format, &file->image_size) != 0)
+    {
+        fprintf (stderr, "Error: Failed to read %s.\n", name);
+        return RC_ERROR;
+    }
+    spng_ctx_free (spng_context);
+
+    file->image = malloc (file->image_size);
+    if (file->image == NULL || bench_decode (file, false) != RC_OK)
+    {
+        fprintf (stderr, "Error: Failed to decode %s.\n", name);
+        return RC_ERROR;
+    }
+
+    total_size += file->size;
+    return RC_OK;
+}
+
+
+/*
+ * Time decoding every file, returning the nanoseconds per round.
+ */
+static double bench_run (bool trusted)
+{
+    uint64_t start = bench_time_ns ();
+
+    for (uint32_t round = 0; round < ROUNDS; round++)
+    {
+        for (uint32_t i = 0; i < file_count; i++)
+        {
+            bench_decode (&files [i], trusted);
+        }
+    }
+
+    return (double) (bench_time_ns () - start) / ROUNDS;
+}
+
+
+/*
+ * Entry point.
+ */
+int main (int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf (stderr, "Usage: %s tiles.png [more_tiles.png..]\n", argv [0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (bench_load_file (argv [i]) != RC_OK)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Warm up, so that the first mode timed isn't penalised */
+    bench_run (false);
+
+    double checked_ns = bench_run (false);
+    double trusted_ns = bench_run (true);
+
+    printf ("Files: %u, %zu bytes, %u rounds\n\n", file_count, total_size, ROUNDS);
+    printf ("%-24s %12s %12s\n", "Mode", "Time (ms)", "MB/s");
+    printf ("%-24s %12.3f %12.2f\n", "checked", checked_ns / 1e6, total_size / (checked_ns / 1e3));
+    printf ("%-24s %12.3f %12.2f\n", "--trusted-input", trusted_ns / 1e6, total_size / (trusted_ns / 1e3));
+    printf ("\nSaving: %.1f%%\n", 100.0 * (checked_ns - trusted_ns) / checked_ns);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Reference decoder for the run-length encoded indices written by --compress-indices.
+ *
+ * The data starts with the size of the low-byte stream, as a 16-bit little-endian
+ * value. The low-byte stream follows, and then the high-byte stream. Each stream
+ * is a sequence of:
+ *   $00-$7f: n + 1 literal bytes follow
+ *   $80-$bf: The next byte is repeated (n & $3f) + 3 times
+ *   $c0-$ff: The next byte is repeated (n & $3f) + 3 times, adding one each time
+ *
+ * Both streams are read together, so the name-table entries come out in order,
+ * low byte first. By default they are written to memory. To write them straight
+ * to VRAM, define INDICES_RLE_WRITE to write to the VDP data port, and set the
+ * VDP address before calling indices_rle_decode. For example, with devkitSMS:
+ *   #define INDICES_RLE_WRITE(value) (VDPDataPort = (value))
+ *
+ * As the data port only needs a single write per byte, this avoids the copy
+ * through RAM, and reads fewer bytes from ROM than the uncompressed indices.
+ */
+
+#include <stdint.h>
+
+#ifndef INDICES_RLE_WRITE
+#define INDICES_RLE_WRITE(value) (*output++ = (value))
+#endif
+
+
+/*
+ * Decode count name-table entries.
+ */
+void indices_rle_decode (const uint8_t *data, uint16_t count, uint8_t *output)
+{
+    const uint8_t *low = data + 2;
+    const uint8_t *high = data + 2 + (data [0] | (data [1] << 8));
+    uint8_t low_remaining = 0;
+    uint8_t high_remaining = 0;
+    uint8_t low_run = 0;
+    uint8_t low_step = 0;
+    uint8_t high_run = 0;
+    uint8_t high_step = 0;
+    uint8_t low_value = 0;
+    uint8_t high_value = 0;
+
+    (void) output;
+
+    while (count--)
+    {
+        if (low_remaining == 0)
+        {
+            uint8_t control = *low++;
+            low_run = control & 0x80;
+            if (low_run)
+            {
+                low_remaining = (control & 0x3f) + 3;
+                low_step = (control & 0x40) ? 1 : 0;
+                low_value = *low++;
+            }
+            else
+            {
+                low_remaining = control + 1;
+                low_step = 0;
+            }
+        }
+        if (!low_run)
+        {
+            low_value = *low++;
+        }
+        low_remaining--;
+
+        if (high_remaining == 0)
+        {
+            uint8_t control = *high++;
+            high_run = control & 0x80;
+            if (high_run)
+            {
+                high_remaining = (control & 0x3f) + 3;
+                high_step = (control & 0x40) ? 1 : 0;
+                high_value = *high++;
+            }
+            else
+            {
+                high_remaining = control + 1;
+                high_step = 0;
+            }
+        }
+        if (!high_run)
+        {
+            high_value = *high++;
+        }
+        high_remaining--;
+
+        INDICES_RLE_WRITE (low_value);
+        INDICES_RLE_WRITE (high_value);
+        low_value += low_step;
+        high_value += high_step;
+    }
+}
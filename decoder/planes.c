@@ -0,0 +1,96 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Reference decoder for the patterns written by --compress planes.
+ *
+ * The data starts with the number of tiles, as a 16-bit little-endian value.
+ * Each tile then has a byte giving the method used for each bitplane, two bits
+ * each with bitplane 0 in the highest bits, followed by the data for each
+ * bitplane that needs it, in order:
+ *   %00: All $00
+ *   %01: All $ff
+ *   %10: Eight raw bytes
+ *   %11: One byte. $00-$03 for a copy of that earlier bitplane, $10-$13 for an
+ *        inverted copy. Otherwise, a mask followed by a common byte: each set bit,
+ *        from the highest, is a byte given as a literal, and each clear bit is
+ *        the common byte.
+ *
+ * Each tile is decoded into a 32-byte buffer, and then written out in VDP order.
+ * By default the tiles are written to memory. To write them straight to VRAM,
+ * define PLANES_WRITE to write to the VDP data port, and set the VDP address
+ * before calling planes_decode. For example, with devkitSMS:
+ *   #define PLANES_WRITE(value) (VDPDataPort = (value))
+ */
+
+#include <stdint.h>
+
+#ifndef PLANES_WRITE
+#define PLANES_WRITE(value) (*output++ = (value))
+#endif
+
+
+/*
+ * Decode all of the tiles in the data.
+ */
+void planes_decode (const uint8_t *data, uint8_t *output)
+{
+    uint16_t count = data [0] | (data [1] << 8);
+    uint8_t tile [32];
+
+    (void) output;
+    data += 2;
+
+    while (count--)
+    {
+        uint8_t methods = *data++;
+
+        for (uint8_t plane = 0; plane < 4; plane++)
+        {
+            uint8_t method = (methods >> (6 - 2 * plane)) & 0x03;
+            uint8_t y;
+
+            if (method == 0x00 || method == 0x01)
+            {
+                for (y = 0; y < 8; y++)
+                {
+                    tile [y * 4 + plane] = (method == 0x01) ? 0xff : 0x00;
+                }
+            }
+            else if (method == 0x02)
+            {
+                for (y = 0; y < 8; y++)
+                {
+                    tile [y * 4 + plane] = *data++;
+                }
+            }
+            else if ((*data & 0xec) == 0)
+            {
+                uint8_t earlier = *data & 0x03;
+                uint8_t invert = (*data & 0x10) ? 0xff : 0x00;
+
+                for (y = 0; y < 8; y++)
+                {
+                    tile [y * 4 + plane] = tile [y * 4 + earlier] ^ invert;
+                }
+                data++;
+            }
+            else
+            {
+                uint8_t mask = data [0];
+                uint8_t common = data [1];
+
+                data += 2;
+                for (y = 0; y < 8; y++)
+                {
+                    tile [y * 4 + plane] = (mask & (0x80 >> y)) ? *data++ : common;
+                }
+            }
+        }
+
+        for (uint8_t i = 0; i < 32; i++)
+        {
+            PLANES_WRITE (tile [i]);
+        }
+    }
+}
@@ -0,0 +1,488 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Persistent cache of processed sheets.
+ *
+ * Each entry is stored in its own file in the cache directory. The file is
+ * in a directory named after a hash of the sheet's contents and the options
+ * it was processed with, and is named after a hash of the state left by
+ * earlier sheets that could change the result.
+ *
+ * The decoded tiles of each input file are also kept, in the 'decoded'
+ * directory, so that a file that has not changed since it was last decoded
+ * can be used without reading or decoding it. These are identified by the
+ * file's path, and checked against its modification time and size.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sneptile.h"
+#include "cache.h"
+
+#define CACHE_MAGIC "SNPCACHE"
+#define CACHE_VERSION 3
+
+/* File header, followed by the tile map, patterns, pattern indices and tiles */
+typedef struct cache_header_s {
+    char magic [8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_count;
+    uint32_t pattern_count;
+    uint32_t tile_size;
+    uint32_t palette_added_count [2];
+    uint8_t palette_added [2] [16];
+} cache_header_t;
+
+#define CACHE_TILES_MAGIC "SNPTILES"
+#define CACHE_TILES_VERSION 2
+
+/* Decoded tiles file header, followed by the colours of each tile */
+typedef struct cache_tiles_header_s {
+    char magic [8];
+    uint32_t version;
+    uint32_t target;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t file_size;
+    uint32_t region [4];
+    uint64_t content_hash;
+    uint32_t width;
+    uint32_t height;
+    uint32_t colour_count;
+    uint8_t colours [64];
+} cache_tiles_header_t;
+
+char *cache_dir = NULL;
+bool cache_verify = false;
+
+
+/*
+ * Continue an FNV-1a hash over a block of data.
+ */
+uint64_t cache_hash (uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes [i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+
+/*
+ * Get the path for a cache entry, or for the directory of a sheet's entries if state_key is NULL.
+ */
+static char *cache_path (uint64_t sheet_key, const uint64_t *state_key)
+{
+    char *path = NULL;
+    int ret;
+
+    if (state_key == NULL)
+    {
+        ret = asprintf (&path, "%s/%016llx", cache_dir, (unsigned long long) sheet_key);
+    }
+    else
+    {
+        ret = asprintf (&path, "%s/%016llx/%016llx.cache", cache_dir, (unsigned long long) sheet_key,
+                        (unsigned long long) *state_key);
+    }
+
+    return (ret < 0) ? NULL : path;
+}
+
+
+/*
+ * Check if there are any entries for a sheet.
+ */
+bool cache_probe (uint64_t sheet_key)
+{
+    struct stat dir_stat;
+    char *path = cache_path (sheet_key, NULL);
+    bool found = (path != NULL && stat (path, &dir_stat) == 0);
+
+    free (path);
+
+    return found;
+}
+
+
+/*
+ * Load a cache entry.
+ * Returns RC_ERROR if there is no valid entry for the key.
+ */
+int cache_load (uint64_t sheet_key, uint64_t state_key, cache_entry_t *entry)
+{
+    cache_header_t header;
+    int rc = RC_OK;
+
+    memset (entry, 0, sizeof (cache_entry_t));
+
+    char *path = cache_path (sheet_key, &state_key);
+    if (path == NULL)
+    {
+        return RC_ERROR;
+    }
+
+    FILE *cache_file = fopen (path, "rb");
+    free (path);
+    if (cache_file == NULL)
+    {
+        return RC_ERROR;
+    }
+
+    if (fread (&header, sizeof (header), 1, cache_file) != 1 ||
+        memcmp (header.magic, CACHE_MAGIC, sizeof (header.magic)) != 0 ||
+        header.version != CACHE_VERSION ||
+        header.palette_added_count [0] > 16 || header.palette_added_count [1] > 16)
+    {
+        rc = RC_ERROR;
+    }
+
+    if (rc == RC_OK)
+    {
+        uint32_t tile_pixels = header.tile_size * header.tile_size;
+
+        entry->width = header.width;
+        entry->height = header.height;
+        entry->tile_count = header.tile_count;
+        entry->pattern_count = header.pattern_count;
+        entry->tile_size = header.tile_size;
+        memcpy (entry->palette_added_count, header.palette_added_count, sizeof (entry->palette_added_count));
+        memcpy (entry->palette_added, header.palette_added, sizeof (entry->palette_added));
+
+        entry->tile_map = malloc (header.tile_count * sizeof (uint16_t));
+        entry->patterns = malloc (header.pattern_count * PATTERN_KEY_SIZE);
+        entry->pattern_indices = malloc (header.pattern_count * sizeof (uint32_t));
+        if (tile_pixels != 0)
+        {
+            entry->tiles = malloc (header.pattern_count * tile_pixels);
+        }
+
+        if ((header.tile_count != 0 && entry->tile_map == NULL) ||
+            (header.pattern_count != 0 && (entry->patterns == NULL || entry->pattern_indices == NULL)) ||
+            (header.pattern_count != 0 && tile_pixels != 0 && entry->tiles == NULL) ||
+            fread (entry->tile_map, sizeof (uint16_t), header.tile_count, cache_file) != header.tile_count ||
+            fread (entry->patterns, PATTERN_KEY_SIZE, header.pattern_count, cache_file) != header.pattern_count ||
+            fread (entry->pattern_indices, sizeof (uint32_t), header.pattern_count, cache_file) != header.pattern_count ||
+            (tile_pixels != 0 && fread (entry->tiles, tile_pixels, header.pattern_count, cache_file) != header.pattern_count))
+        {
+            rc = RC_ERROR;
+        }
+    }
+
+    fclose (cache_file);
+
+    if (rc != RC_OK)
+    {
+        cache_entry_free (entry);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Store a cache entry.
+ * The entry is written to a temporary file first, so that
+ * an interrupted run cannot leave a partial entry behind.
+ */
+int cache_store (uint64_t sheet_key, uint64_t state_key, const cache_entry_t *entry)
+{
+    uint32_t tile_pixels = entry->tile_size * entry->tile_size;
+    cache_header_t header = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .width = entry->width,
+        .height = entry->height,
+        .tile_count = entry->tile_count,
+        .pattern_count = entry->pattern_count,
+        .tile_size = entry->tile_size
+    };
+    memcpy (header.palette_added_count, entry->palette_added_count, sizeof (header.palette_added_count));
+    memcpy (header.palette_added, entry->palette_added, sizeof (header.palette_added));
+
+    char *dir_path = cache_path (sheet_key, NULL);
+    if (dir_path != NULL)
+    {
+        mkdir (dir_path, S_IRWXU);
+        free (dir_path);
+    }
+
+    char *path = cache_path (sheet_key, &state_key);
+    char *temp_path = NULL;
+    if (path == NULL || asprintf (&temp_path, "%s.%d", path, (int) getpid ()) < 0)
+    {
+        free (path);
+        return RC_ERROR;
+    }
+
+    int rc = RC_OK;
+    FILE *cache_file = fopen (temp_path, "wb");
+    if (cache_file == NULL)
+    {
+        fprintf (stderr, "Warning: Unable to write cache file %s.\n", temp_path);
+        rc = RC_ERROR;
+    }
+
+    if (rc == RC_OK)
+    {
+        if (fwrite (&header, sizeof (header), 1, cache_file) != 1 ||
+            fwrite (entry->tile_map, sizeof (uint16_t), entry->tile_count, cache_file) != entry->tile_count ||
+            (entry->pattern_count != 0 &&
+             (fwrite (entry->patterns, PATTERN_KEY_SIZE, entry->pattern_count, cache_file) != entry->pattern_count ||
+              fwrite (entry->pattern_indices, sizeof (uint32_t), entry->pattern_count, cache_file) != entry->pattern_count ||
+              (tile_pixels != 0 && fwrite (entry->tiles, tile_pixels, entry->pattern_count, cache_file) != entry->pattern_count))))
+        {
+            rc = RC_ERROR;
+        }
+
+        if (fclose (cache_file) != 0)
+        {
+            rc = RC_ERROR;
+        }
+
+        if (rc == RC_OK && rename (temp_path, path) != 0)
+        {
+            rc = RC_ERROR;
+        }
+
+        if (rc != RC_OK)
+        {
+            fprintf (stderr, "Warning: Unable to write cache file %s.\n", path);
+            remove (temp_path);
+        }
+    }
+
+    free (path);
+    free (temp_path);
+
+    return rc;
+}
+
+
+/*
+ * Free the memory held by a cache entry.
+ */
+void cache_entry_free (cache_entry_t *entry)
+{
+    free (entry->tile_map);
+    free (entry->patterns);
+    free (entry->pattern_indices);
+    free (entry->tiles);
+    memset (entry, 0, sizeof (cache_entry_t));
+}
+
+
+/*
+ * Get the path of the decoded tiles for an input file, or of their directory if file_path is NULL.
+ * Files are identified by their full path, the region used, and the target they are decoded for.
+ */
+static char *cache_tiles_path (const char *file_path, const uint32_t *region)
+{
+    char *path = NULL;
+    int ret;
+
+    if (file_path == NULL)
+    {
+        ret = asprintf (&path, "%s/decoded", cache_dir);
+    }
+    else
+    {
+        char *full_path = realpath (file_path, NULL);
+        uint64_t key = cache_hash (CACHE_HASH_INIT, (full_path != NULL) ? full_path : file_path,
+                                   strlen ((full_path != NULL) ? full_path : file_path));
+        key = cache_hash (key, region, 4 * sizeof (uint32_t));
+        key = cache_hash (key, &target, sizeof (target));
+        free (full_path);
+
+        ret = asprintf (&path, "%s/decoded/%016llx.tiles", cache_dir, (unsigned long long) key);
+    }
+
+    return (ret < 0) ? NULL : path;
+}
+
+
+/*
+ * Map the decoded tiles of an input file.
+ * The caller fills in the file's modification time and size, which must
+ * match those recorded when the tiles were stored.
+ * Returns RC_ERROR if there are no valid tiles for the file.
+ */
+int cache_tiles_load (const char *file_path, cache_tiles_t *entry)
+{
+    const cache_tiles_header_t *header;
+    struct stat tiles_stat;
+    int rc = RC_OK;
+
+    char *path = cache_tiles_path (file_path, entry->region);
+    if (path == NULL)
+    {
+        return RC_ERROR;
+    }
+
+    int tiles_fd = open (path, O_RDONLY);
+    free (path);
+    if (tiles_fd == -1)
+    {
+        return RC_ERROR;
+    }
+
+    if (fstat (tiles_fd, &tiles_stat) != 0 || tiles_stat.st_size < (off_t) sizeof (cache_tiles_header_t))
+    {
+        close (tiles_fd);
+        return RC_ERROR;
+    }
+
+    entry->mapping_size = tiles_stat.st_size;
+    entry->mapping = mmap (NULL, entry->mapping_size, PROT_READ, MAP_PRIVATE, tiles_fd, 0);
+    close (tiles_fd);
+    if (entry->mapping == MAP_FAILED)
+    {
+        entry->mapping = NULL;
+        return RC_ERROR;
+    }
+
+    header = entry->mapping;
+    if (memcmp (header->magic, CACHE_TILES_MAGIC, sizeof (header->magic)) != 0 ||
+        header->version != CACHE_TILES_VERSION ||
+        header->target != target ||
+        header->mtime_sec != entry->mtime_sec ||
+        header->mtime_nsec != entry->mtime_nsec ||
+        header->file_size != entry->file_size ||
+        memcmp (header->region, entry->region, sizeof (header->region)) != 0 ||
+        header->colour_count > 64 ||
+        entry->mapping_size != sizeof (cache_tiles_header_t) + (size_t) header->width * header->height)
+    {
+        rc = RC_ERROR;
+    }
+
+    if (rc == RC_OK)
+    {
+        entry->content_hash = header->content_hash;
+        entry->width = header->width;
+        entry->height = header->height;
+        entry->colour_count = header->colour_count;
+        memcpy (entry->colours, header->colours, sizeof (entry->colours));
+        entry->tiles = (uint8_t *) entry->mapping + sizeof (cache_tiles_header_t);
+    }
+    else
+    {
+        cache_tiles_free (entry);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Store the decoded tiles of an input file.
+ * As this may be called from several worker threads, each write goes to its own temporary file.
+ */
+int cache_tiles_store (const char *file_path, const cache_tiles_t *entry)
+{
+    cache_tiles_header_t header = {
+        .magic = CACHE_TILES_MAGIC,
+        .version = CACHE_TILES_VERSION,
+        .target = target,
+        .mtime_sec = entry->mtime_sec,
+        .mtime_nsec = entry->mtime_nsec,
+        .file_size = entry->file_size,
+        .content_hash = entry->content_hash,
+        .width = entry->width,
+        .height = entry->height,
+        .colour_count = entry->colour_count
+    };
+    memcpy (header.colours, entry->colours, sizeof (header.colours));
+    memcpy (header.region, entry->region, sizeof (header.region));
+
+    char *dir_path = cache_tiles_path (NULL, NULL);
+    if (dir_path != NULL)
+    {
+        mkdir (dir_path, S_IRWXU);
+        free (dir_path);
+    }
+
+    char *path = cache_tiles_path (file_path, entry->region);
+    char *temp_path = NULL;
+    if (path == NULL || asprintf (&temp_path, "%s.XXXXXX", path) < 0)
+    {
+        free (path);
+        return RC_ERROR;
+    }
+
+    int rc = RC_OK;
+    int temp_fd = mkstemp (temp_path);
+    FILE *tiles_file = (temp_fd == -1) ? NULL : fdopen (temp_fd, "wb");
+    if (tiles_file == NULL)
+    {
+        fprintf (stderr, "Warning: Unable to write cache file %s.\n", path);
+        if (temp_fd != -1)
+        {
+            close (temp_fd);
+            remove (temp_path);
+        }
+        rc = RC_ERROR;
+    }
+
+    if (rc == RC_OK)
+    {
+        size_t tiles_size = (size_t) entry->width * entry->height;
+
+        if (fwrite (&header, sizeof (header), 1, tiles_file) != 1 ||
+            (tiles_size != 0 && fwrite (entry->tiles, tiles_size, 1, tiles_file) != 1))
+        {
+            rc = RC_ERROR;
+        }
+
+        if (fclose (tiles_file) != 0)
+        {
+            rc = RC_ERROR;
+        }
+
+        if (rc == RC_OK && rename (temp_path, path) != 0)
+        {
+            rc = RC_ERROR;
+        }
+
+        if (rc != RC_OK)
+        {
+            fprintf (stderr, "Warning: Unable to write cache file %s.\n", path);
+            remove (temp_path);
+        }
+    }
+
+    free (path);
+    free (temp_path);
+
+    return rc;
+}
+
+
+/*
+ * Unmap decoded tiles.
+ */
+void cache_tiles_free (cache_tiles_t *entry)
+{
+    if (entry->mapping != NULL)
+    {
+        munmap (entry->mapping, entry->mapping_size);
+    }
+    entry->mapping = NULL;
+    entry->mapping_size = 0;
+    entry->tiles = NULL;
+}
@@ -0,0 +1,79 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ */
+
+#define CACHE_HASH_INIT 14695981039346656037ull
+
+/* Result of processing a single sheet */
+typedef struct cache_entry_s {
+    uint32_t width;
+    uint32_t height;
+
+    /* Pattern index of each tile */
+    uint32_t tile_count;
+    uint16_t *tile_map;
+
+    /* Patterns generated by the sheet, in order */
+    uint32_t pattern_count;
+    uint8_t *patterns;
+    uint32_t *pattern_indices;
+
+    /* Colours of each generated pattern, for targets that generate patterns from colours */
+    uint32_t tile_size;
+    uint8_t *tiles;
+
+    /* Colours added to the background and sprite palettes */
+    uint32_t palette_added_count [2];
+    uint8_t palette_added [2] [16];
+} cache_entry_t;
+
+/* Decoded tiles of an input file, mapped from the cache */
+typedef struct cache_tiles_s {
+    /* Identifies the version of the file that was decoded */
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t file_size;
+    uint32_t region [4];
+    uint64_t content_hash;
+
+    /* The sheet's colours, and the colours of each tile, as kept by a sheet_t */
+    uint32_t width;
+    uint32_t height;
+    uint32_t colour_count;
+    uint8_t colours [64];
+    uint8_t *tiles;
+
+    void *mapping;
+    size_t mapping_size;
+} cache_tiles_t;
+
+/* Cache directory, or NULL if caching is disabled */
+extern char *cache_dir;
+
+/* Also check decoded tiles against a hash of the file contents */
+extern bool cache_verify;
+
+/* Continue an FNV-1a hash over a block of data. */
+uint64_t cache_hash (uint64_t hash, const void *data, size_t size);
+
+/* Check if there are any entries for a sheet. */
+bool cache_probe (uint64_t sheet_key);
+
+/* Load a cache entry. */
+int cache_load (uint64_t sheet_key, uint64_t state_key, cache_entry_t *entry);
+
+/* Store a cache entry. */
+int cache_store (uint64_t sheet_key, uint64_t state_key, const cache_entry_t *entry);
+
+/* Free the memory held by a cache entry. */
+void cache_entry_free (cache_entry_t *entry);
+
+/* Map the decoded tiles of an input file. */
+int cache_tiles_load (const char *file_path, cache_tiles_t *entry);
+
+/* Store the decoded tiles of an input file. */
+int cache_tiles_store (const char *file_path, const cache_tiles_t *entry);
+
+/* Unmap decoded tiles. */
+void cache_tiles_free (cache_tiles_t *entry);
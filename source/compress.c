@@ -0,0 +1,573 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Pattern compression, so that compressed patterns can be written alongside
+ * the raw ones without running a separate compressor over the output.
+ *
+ * Two formats are supported:
+ *
+ *  - Sneptile's own planes format, encoding each bitplane of each tile on its own.
+ *    Bitplanes that are blank, solid, or copies of an earlier bitplane in the
+ *    same tile cost at most one byte. It decompresses quickly, straight to VRAM,
+ *    using the reference decoder in decoder/planes.c.
+ *
+ *  - ZX7, a general purpose LZ77 format with an Elias-gamma coded bit stream,
+ *    which usually compresses further, at the cost of slower decompression.
+ *
+ * Name-table entries can also be run-length encoded. The low and high bytes of
+ * the entries are kept in separate streams, as the high bytes (the pattern
+ * index's ninth bit, and the flip, palette and priority bits) are mostly the
+ * same across a whole map. As patterns are generated in the order their tiles
+ * first appear, the low bytes also have runs of incrementing values.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sneptile.h"
+#include "compress.h"
+
+uint32_t compress_codecs = 0;
+bool compress_indices = false;
+
+/* ZX7 limits */
+#define ZX7_MAX_OFFSET  2176
+#define ZX7_MAX_LENGTH  65536
+
+/* Number of earlier positions to try matching against at each position */
+#define ZX7_MAX_CHAIN   256
+
+/* Beyond this, only the longest length of each match is considered */
+#define ZX7_SHORT_LENGTH 64
+
+/* Stop looking for a longer match once one this long has been found */
+#define ZX7_GOOD_LENGTH 256
+
+/* Run-length encoding limits */
+#define RLE_MAX_LITERAL 128
+#define RLE_MIN_RUN     3
+#define RLE_MAX_RUN     (RLE_MIN_RUN + 63)
+
+/* Bit stream state while writing ZX7 data */
+typedef struct zx7_writer_s {
+    uint8_t *data;
+    size_t size;
+    size_t bit_index;
+    uint8_t bit_mask;
+} zx7_writer_t;
+
+
+/*
+ * Write one bitplane of a tile in the planes format.
+ * Returns the two-bit method used.
+ */
+static uint8_t compress_planes_bitplane (const uint8_t *tile, uint32_t plane, uint8_t *output, size_t *size)
+{
+    uint8_t bytes [8];
+    uint32_t counts [256] = { };
+    uint8_t common = 0;
+    uint8_t mask = 0;
+
+    for (uint32_t y = 0; y < 8; y++)
+    {
+        bytes [y] = tile [y * 4 + plane];
+    }
+
+    /* %00 and %01: Blank and solid bitplanes */
+    if (memcmp (bytes, "\x00\x00\x00\x00\x00\x00\x00\x00", 8) == 0)
+    {
+        return 0x00;
+    }
+    if (memcmp (bytes, "\xff\xff\xff\xff\xff\xff\xff\xff", 8) == 0)
+    {
+        return 0x01;
+    }
+
+    /* %11 with $0n or $1n: A copy, or an inverted copy, of an earlier bitplane */
+    for (uint32_t earlier = 0; earlier < plane; earlier++)
+    {
+        bool copy = true;
+        bool inverted = true;
+
+        for (uint32_t y = 0; y < 8; y++)
+        {
+            uint8_t earlier_byte = tile [y * 4 + earlier];
+            uint8_t earlier_inverse = ~earlier_byte;
+
+            copy = copy && bytes [y] == earlier_byte;
+            inverted = inverted && bytes [y] == earlier_inverse;
+        }
+
+        if (copy || inverted)
+        {
+            output [(*size)++] = (inverted ? 0x10 : 0x00) | earlier;
+            return 0x03;
+        }
+    }
+
+    /* %11 with a mask: The most common byte, with a literal for each set bit */
+    for (uint32_t y = 0; y < 8; y++)
+    {
+        if (++counts [bytes [y]] > counts [common])
+        {
+            common = bytes [y];
+        }
+    }
+    for (uint32_t y = 0; y < 8; y++)
+    {
+        if (bytes [y] != common)
+        {
+            mask |= 0x80 >> y;
+        }
+    }
+
+    /* Masks that look like a copy are avoided by sending the first byte as a literal */
+    if ((mask & 0xec) == 0)
+    {
+        mask |= 0x80;
+    }
+
+    /* %10: Raw bytes, if the mask would not be any smaller */
+    if (2 + __builtin_popcount (mask) >= 8)
+    {
+        memcpy (&output [*size], bytes, 8);
+        *size += 8;
+        return 0x02;
+    }
+
+    output [(*size)++] = mask;
+    output [(*size)++] = common;
+    for (uint32_t y = 0; y < 8; y++)
+    {
+        if (mask & (0x80 >> y))
+        {
+            output [(*size)++] = bytes [y];
+        }
+    }
+
+    return 0x03;
+}
+
+
+/*
+ * Compress mode-4 patterns in the planes format.
+ *
+ * The data starts with the number of tiles, as a 16-bit little-endian value.
+ * Each tile then has a byte giving the method used for each bitplane, two bits
+ * each with bitplane 0 in the highest bits, followed by the data for each
+ * bitplane that needs it, in order:
+ *   %00: All $00
+ *   %01: All $ff
+ *   %10: Eight raw bytes
+ *   %11: One byte. $00-$03 for a copy of that earlier bitplane, $10-$13 for an
+ *        inverted copy. Otherwise, a mask followed by a common byte: each set bit,
+ *        from the highest, is a byte given as a literal, and each clear bit is
+ *        the common byte.
+ *
+ * Returns NULL if memory cannot be allocated.
+ */
+uint8_t *compress_planes (const uint8_t *patterns, uint32_t pattern_count, size_t *compressed_size)
+{
+    uint8_t *output = malloc (2 + (size_t) pattern_count * 37);
+    size_t size = 0;
+
+    if (output == NULL)
+    {
+        return NULL;
+    }
+
+    output [size++] = pattern_count & 0xff;
+    output [size++] = pattern_count >> 8;
+
+    for (uint32_t i = 0; i < pattern_count; i++)
+    {
+        const uint8_t *tile = &patterns [i * 32];
+        size_t method_index = size++;
+        uint8_t methods = 0;
+
+        for (uint32_t plane = 0; plane < 4; plane++)
+        {
+            methods |= compress_planes_bitplane (tile, plane, output, &size) << (6 - 2 * plane);
+        }
+
+        output [method_index] = methods;
+    }
+
+    *compressed_size = size;
+    return output;
+}
+
+
+/*
+ * Write a single bit to the ZX7 bit stream.
+ * Bits are packed into bytes placed in the output as they are needed.
+ */
+static void zx7_write_bit (zx7_writer_t *writer, bool bit)
+{
+    if (writer->bit_mask == 0)
+    {
+        writer->bit_mask = 0x80;
+        writer->bit_index = writer->size;
+        writer->data [writer->size++] = 0;
+    }
+    if (bit)
+    {
+        writer->data [writer->bit_index] |= writer->bit_mask;
+    }
+    writer->bit_mask >>= 1;
+}
+
+
+/*
+ * Write an Elias-gamma coded value to the ZX7 bit stream.
+ */
+static void zx7_write_gamma (zx7_writer_t *writer, uint32_t value)
+{
+    uint32_t i;
+
+    for (i = 2; i <= value; i <<= 1)
+    {
+        zx7_write_bit (writer, false);
+    }
+    while ((i >>= 1) > 0)
+    {
+        zx7_write_bit (writer, value & i);
+    }
+}
+
+
+/*
+ * Number of bits used to Elias-gamma code a value.
+ */
+static uint32_t zx7_gamma_bits (uint32_t value)
+{
+    uint32_t bits = 1;
+
+    while (value > 1)
+    {
+        bits += 2;
+        value >>= 1;
+    }
+
+    return bits;
+}
+
+
+/*
+ * Compress a block of data in the ZX7 format.
+ *
+ * The parse is found by working forwards through the data, keeping the cheapest
+ * way to reach each position. Matches are found through hash chains of the
+ * two-byte sequences at each position.
+ *
+ * Returns NULL if memory cannot be allocated, or if there is no data.
+ */
+uint8_t *compress_zx7 (const uint8_t *data, size_t size, size_t *compressed_size)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+    uint32_t *cost = malloc ((size + 1) * sizeof (uint32_t));
+    uint32_t *step_length = malloc ((size + 1) * sizeof (uint32_t));
+    uint32_t *step_offset = malloc ((size + 1) * sizeof (uint32_t));
+    int32_t *chain = malloc (size * sizeof (int32_t));
+    int32_t *head = malloc (65536 * sizeof (int32_t));
+    uint8_t *output = malloc (size + size / 8 + 16);
+    zx7_writer_t writer = { .data = output };
+
+    if (cost == NULL || step_length == NULL || step_offset == NULL || chain == NULL || head == NULL || output == NULL)
+    {
+        free (output);
+        output = NULL;
+        goto done;
+    }
+
+    memset (head, 0xff, 65536 * sizeof (int32_t));
+    memset (cost, 0xff, (size + 1) * sizeof (uint32_t));
+
+    /* The first byte is always a literal, without a flag bit */
+    cost [1] = 8;
+    step_length [1] = 1;
+
+    /* Longest match at the previous position. Within runs, each position
+     * matches at the same offset for one less, so it need not be compared again. */
+    uint32_t previous_offset = 0;
+    size_t previous_length = 0;
+
+    for (size_t i = 1; i < size; i++)
+    {
+        /* Make position i - 1 available to match against */
+        uint32_t key = data [i - 1] << 8 | data [i];
+        chain [i - 1] = head [key];
+        head [key] = i - 1;
+
+        /* Literal */
+        if (cost [i] + 9 < cost [i + 1])
+        {
+            cost [i + 1] = cost [i] + 9;
+            step_length [i + 1] = 1;
+        }
+
+        if (i + 1 >= size)
+        {
+            continue;
+        }
+
+        uint32_t best_offset = 0;
+        size_t best_length = 0;
+
+        /* Matches against earlier positions starting with the same two bytes */
+        size_t max_length = size - i < ZX7_MAX_LENGTH ? size - i : ZX7_MAX_LENGTH;
+        key = data [i] << 8 | data [i + 1];
+        uint32_t chain_length = 0;
+
+        for (int32_t p = head [key]; p >= 0 && chain_length < ZX7_MAX_CHAIN; p = chain [p], chain_length++)
+        {
+            uint32_t offset = i - p;
+            if (offset > ZX7_MAX_OFFSET)
+            {
+                break;
+            }
+
+            size_t length = (offset == previous_offset && previous_length > 2) ? previous_length - 1 : 2;
+            while (length < max_length && data [p + length] == data [i + length])
+            {
+                length++;
+            }
+
+            if (length > best_length)
+            {
+                best_length = length;
+                best_offset = offset;
+            }
+
+            uint32_t match_cost = cost [i] + 1 + ((offset <= 128) ? 8 : 12);
+            for (size_t l = 2; l <= length; l++)
+            {
+                if (l > ZX7_SHORT_LENGTH && l != length)
+                {
+                    l = length;
+                }
+
+                uint32_t total = match_cost + zx7_gamma_bits (l - 1);
+                if (total < cost [i + l])
+                {
+                    cost [i + l] = total;
+                    step_length [i + l] = l;
+                    step_offset [i + l] = offset;
+                }
+            }
+
+            /* Nothing further back can match for longer, or there is no need to */
+            if (length == max_length || length >= ZX7_GOOD_LENGTH)
+            {
+                break;
+            }
+        }
+
+        previous_offset = best_offset;
+        previous_length = best_length;
+    }
+
+    /* Walk back from the end to find the chosen steps, reusing the cost array for the path */
+    size_t steps = 0;
+    for (size_t i = size; i > 1; i -= step_length [i])
+    {
+        cost [steps++] = i;
+    }
+
+    output [writer.size++] = data [0];
+
+    while (steps > 0)
+    {
+        size_t end = cost [--steps];
+        uint32_t length = step_length [end];
+
+        if (length == 1)
+        {
+            zx7_write_bit (&writer, false);
+            output [writer.size++] = data [end - 1];
+        }
+        else
+        {
+            uint32_t offset = step_offset [end] - 1;
+
+            zx7_write_bit (&writer, true);
+            zx7_write_gamma (&writer, length - 1);
+
+            if (offset < 128)
+            {
+                output [writer.size++] = offset;
+            }
+            else
+            {
+                offset -= 128;
+                output [writer.size++] = (offset & 0x7f) | 0x80;
+                for (uint32_t mask = 1024; mask > 127; mask >>= 1)
+                {
+                    zx7_write_bit (&writer, offset & mask);
+                }
+            }
+        }
+    }
+
+    /* End marker */
+    zx7_write_bit (&writer, true);
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        zx7_write_bit (&writer, false);
+    }
+    zx7_write_bit (&writer, true);
+
+    *compressed_size = writer.size;
+
+done:
+    free (cost);
+    free (step_length);
+    free (step_offset);
+    free (chain);
+    free (head);
+
+    return output;
+}
+
+
+/*
+ * Write any pending literal bytes of a run-length encoded stream.
+ */
+static void compress_rle_literals (const uint8_t *literals, uint32_t count, uint8_t *output, size_t *size)
+{
+    if (count != 0)
+    {
+        output [(*size)++] = count - 1;
+        memcpy (&output [*size], literals, count);
+        *size += count;
+    }
+}
+
+
+/*
+ * Find the length of the run starting at bytes [i * stride], with each
+ * following byte being step more than the one before.
+ */
+static uint32_t compress_rle_run (const uint8_t *bytes, uint32_t count, uint32_t stride, uint32_t i, uint8_t step)
+{
+    uint8_t value = bytes [i * stride];
+    uint32_t run = 1;
+
+    while (i + run < count && run < RLE_MAX_RUN && bytes [(i + run) * stride] == (uint8_t) (value + run * step))
+    {
+        run++;
+    }
+
+    return run;
+}
+
+
+/*
+ * Run-length encode every stride'th byte, starting from the first.
+ * Returns the size of the encoded stream.
+ */
+static size_t compress_rle_stream (const uint8_t *bytes, uint32_t count, uint32_t stride, uint8_t *output)
+{
+    uint8_t literals [RLE_MAX_LITERAL];
+    uint32_t literal_count = 0;
+    size_t size = 0;
+
+    for (uint32_t i = 0; i < count; )
+    {
+        uint8_t value = bytes [i * stride];
+        uint32_t run = compress_rle_run (bytes, count, stride, i, 0);
+        uint32_t increment_run = compress_rle_run (bytes, count, stride, i, 1);
+
+        if (run >= RLE_MIN_RUN || increment_run >= RLE_MIN_RUN)
+        {
+            compress_rle_literals (literals, literal_count, output, &size);
+            literal_count = 0;
+
+            if (increment_run > run)
+            {
+                output [size++] = 0xc0 | (increment_run - RLE_MIN_RUN);
+                run = increment_run;
+            }
+            else
+            {
+                output [size++] = 0x80 | (run - RLE_MIN_RUN);
+            }
+            output [size++] = value;
+            i += run;
+        }
+        else
+        {
+            literals [literal_count++] = value;
+            if (literal_count == RLE_MAX_LITERAL)
+            {
+                compress_rle_literals (literals, literal_count, output, &size);
+                literal_count = 0;
+            }
+            i++;
+        }
+    }
+
+    compress_rle_literals (literals, literal_count, output, &size);
+
+    return size;
+}
+
+
+/*
+ * Run-length encode name-table entries, as separate low-byte and high-byte streams.
+ *
+ * The data starts with the size of the low-byte stream, as a 16-bit little-endian
+ * value, so that a decoder can read both streams together and write the entries
+ * straight to VRAM. The low-byte stream follows, and then the high-byte stream.
+ * Each stream is a sequence of:
+ *   $00-$7f: n + 1 literal bytes follow
+ *   $80-$bf: The next byte is repeated (n & $3f) + 3 times
+ *   $c0-$ff: The next byte is repeated (n & $3f) + 3 times, adding one each time
+ * The streams have no end marker, as the number of entries is known.
+ *
+ * Returns NULL if memory cannot be allocated, or if the low-byte stream
+ * is too large for its size to be given in 16 bits.
+ */
+uint8_t *compress_indices_rle (const uint16_t *indices, uint32_t count, size_t *compressed_size)
+{
+    uint8_t *bytes = malloc ((size_t) count * 2);
+    uint8_t *output = malloc (2 + 2 * ((size_t) count + count / RLE_MAX_LITERAL + 1));
+    size_t low_size;
+
+    if (bytes == NULL || output == NULL)
+    {
+        free (bytes);
+        free (output);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        bytes [i * 2] = indices [i] & 0xff;
+        bytes [i * 2 + 1] = indices [i] >> 8;
+    }
+
+    low_size = compress_rle_stream (&bytes [0], count, 2, &output [2]);
+    if (low_size > 0xffff)
+    {
+        free (bytes);
+        free (output);
+        return NULL;
+    }
+    output [0] = low_size & 0xff;
+    output [1] = low_size >> 8;
+
+    *compressed_size = 2 + low_size + compress_rle_stream (&bytes [1], count, 2, &output [2 + low_size]);
+
+    free (bytes);
+    return output;
+}
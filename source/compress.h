@@ -0,0 +1,21 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ */
+
+/* Codecs to compress each sheet's patterns with */
+#define COMPRESS_PLANES     0x01
+#define COMPRESS_ZX7        0x02
+extern uint32_t compress_codecs;
+
+/* Also write the mode-4 indices run-length encoded */
+extern bool compress_indices;
+
+/* Compress mode-4 patterns in the planes format, one bitplane at a time. */
+uint8_t *compress_planes (const uint8_t *patterns, uint32_t pattern_count, size_t *compressed_size);
+
+/* Compress a block of data in the ZX7 format. */
+uint8_t *compress_zx7 (const uint8_t *data, size_t size, size_t *compressed_size);
+
+/* Run-length encode name-table entries, as separate low-byte and high-byte streams. */
+uint8_t *compress_indices_rle (const uint16_t *indices, uint32_t count, size_t *compressed_size);
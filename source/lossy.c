@@ -0,0 +1,391 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Lossy de-duplication.
+ *
+ * Patterns are merged into their most similar neighbour until the budget is met.
+ * The distance between two patterns is the sum, over their 64 pixels, of the
+ * weighted Euclidean distance between the two SMS colours. As this is a metric,
+ * nearest neighbours can be found using a vantage-point tree.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sneptile.h"
+#include "lossy.h"
+
+/* Largest distance between two visible colours, with every channel
+ * differing by three: sqrt (3 * 3² + 4 * 3² + 2 * 3²) */
+#define MAX_COLOUR_DISTANCE 9.0f
+
+/* Distance between a transparent pixel and any visible colour.
+ * Larger than the distance between any two colours, and at
+ * most twice it, so that the triangle inequality still holds. */
+#define TRANSPARENT_DISTANCE (MAX_COLOUR_DISTANCE + 1.0f)
+
+typedef struct vp_node_s {
+    uint32_t item;      /* Vantage point, index into the items being searched */
+    float radius;       /* Median distance from the vantage point */
+    int32_t inside;     /* Node for items within the radius, or -1 */
+    int32_t outside;    /* Node for items beyond the radius, or -1 */
+} vp_node_t;
+
+typedef struct vp_tree_s {
+    vp_node_t *nodes;
+    uint32_t node_count;
+    uint32_t *items;
+    float *distances;
+} vp_tree_t;
+
+/* Merge candidate, sorted by cost */
+typedef struct lossy_candidate_s {
+    uint32_t item;
+    uint32_t neighbour;
+    float cost;
+} lossy_candidate_t;
+
+/* State for the current reduction */
+static uint8_t (*pixels) [64] = NULL;
+static float colour_distance [16] [16];
+
+
+/*
+ * Build the table of distances between the palette entries.
+ */
+static void lossy_build_distance_table (const uint8_t *colours)
+{
+    for (uint32_t a = 0; a < 16; a++)
+    {
+        for (uint32_t b = 0; b < 16; b++)
+        {
+            if (colours [a] == LOSSY_TRANSPARENT || colours [b] == LOSSY_TRANSPARENT)
+            {
+                colour_distance [a] [b] = (colours [a] == colours [b]) ? 0.0f : TRANSPARENT_DISTANCE;
+                continue;
+            }
+
+            /* Channels are two bits each, weighted towards green as the eye is most sensitive to it */
+            int32_t dr = (int32_t) ( colours [a]       & 0x03) - ( colours [b]       & 0x03);
+            int32_t dg = (int32_t) ((colours [a] >> 2) & 0x03) - ((colours [b] >> 2) & 0x03);
+            int32_t db = (int32_t) ((colours [a] >> 4) & 0x03) - ((colours [b] >> 4) & 0x03);
+
+            colour_distance [a] [b] = sqrtf (3 * dr * dr + 4 * dg * dg + 2 * db * db);
+        }
+    }
+}
+
+
+/*
+ * Distance between two patterns.
+ */
+static float lossy_distance (uint32_t a, uint32_t b)
+{
+    float distance = 0.0f;
+
+    for (uint32_t i = 0; i < 64; i++)
+    {
+        distance += colour_distance [pixels [a] [i]] [pixels [b] [i]];
+    }
+
+    return distance;
+}
+
+
+/*
+ * Recursively build the vantage-point tree for items [start, end).
+ * Returns the index of the new node, or -1 for an empty range.
+ */
+static int32_t lossy_vp_build (vp_tree_t *tree, uint32_t start, uint32_t end)
+{
+    if (start == end)
+    {
+        return -1;
+    }
+
+    int32_t node_index = tree->node_count++;
+    vp_node_t *node = &tree->nodes [node_index];
+    node->item = tree->items [start];
+    node->radius = 0.0f;
+
+    if (end - start > 1)
+    {
+        /* Partition the remaining items around the median distance from the vantage point */
+        uint32_t low = start + 1;
+        uint32_t high = end - 1;
+        uint32_t median = (start + 1 + end) / 2;
+
+        for (uint32_t i = start + 1; i < end; i++)
+        {
+            tree->distances [i] = lossy_distance (node->item, tree->items [i]);
+        }
+
+        /* Quickselect */
+        while (low < high)
+        {
+            float pivot = tree->distances [(low + high) / 2];
+            uint32_t i = low;
+            uint32_t j = high;
+
+            while (i <= j)
+            {
+                while (tree->distances [i] < pivot) i++;
+                while (tree->distances [j] > pivot) j--;
+                if (i <= j)
+                {
+                    float swap_distance = tree->distances [i];
+                    tree->distances [i] = tree->distances [j];
+                    tree->distances [j] = swap_distance;
+
+                    uint32_t swap_item = tree->items [i];
+                    tree->items [i] = tree->items [j];
+                    tree->items [j] = swap_item;
+
+                    i++;
+                    j--;
+                }
+            }
+
+            if (median <= j)
+            {
+                high = j;
+            }
+            else if (median >= i)
+            {
+                low = i;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        node->radius = tree->distances [median];
+        node->inside = lossy_vp_build (tree, start + 1, median);
+        node->outside = lossy_vp_build (tree, median, end);
+    }
+    else
+    {
+        node->inside = -1;
+        node->outside = -1;
+    }
+
+    return node_index;
+}
+
+
+/*
+ * Find the nearest neighbour of an item, other than itself.
+ */
+static void lossy_vp_search (vp_tree_t *tree, int32_t node_index, uint32_t item,
+                             uint32_t *best_item, float *best_distance)
+{
+    if (node_index == -1)
+    {
+        return;
+    }
+
+    vp_node_t *node = &tree->nodes [node_index];
+    float distance = lossy_distance (item, node->item);
+
+    if (node->item != item && distance < *best_distance)
+    {
+        *best_distance = distance;
+        *best_item = node->item;
+    }
+
+    /* Search the more likely side first, and only search the other
+     * side if it could contain something closer than the best so far */
+    if (distance < node->radius)
+    {
+        lossy_vp_search (tree, node->inside, item, best_item, best_distance);
+        if (distance + *best_distance >= node->radius)
+        {
+            lossy_vp_search (tree, node->outside, item, best_item, best_distance);
+        }
+    }
+    else
+    {
+        lossy_vp_search (tree, node->outside, item, best_item, best_distance);
+        if (distance - *best_distance <= node->radius)
+        {
+            lossy_vp_search (tree, node->inside, item, best_item, best_distance);
+        }
+    }
+}
+
+
+/*
+ * Comparison for sorting candidates by cost.
+ * Ties are broken by item, so that the result does not depend on the sort.
+ */
+static int lossy_candidate_compare (const void *a, const void *b)
+{
+    const lossy_candidate_t *candidate_a = a;
+    const lossy_candidate_t *candidate_b = b;
+
+    if (candidate_a->cost != candidate_b->cost)
+    {
+        return (candidate_a->cost < candidate_b->cost) ? -1 : 1;
+    }
+
+    return (candidate_a->item < candidate_b->item) ? -1 : (candidate_a->item > candidate_b->item);
+}
+
+
+/*
+ * Merge patterns until at most max_patterns remain.
+ *
+ * Each round, every remaining pattern finds its nearest neighbour. Patterns are then
+ * merged into their neighbour in order of cost (distance × weight), until either the
+ * budget is met or the round runs out of pairs where both patterns are still present.
+ * A pattern that has received a merge this round is kept, so that each merge is based
+ * on up-to-date neighbours.
+ */
+static void lossy_merge (vp_tree_t *tree, lossy_candidate_t *candidates, uint32_t *weights, bool *merged_this_round,
+                         uint32_t count, uint32_t max_patterns, uint32_t *replacement)
+{
+    uint32_t remaining = count;
+
+    while (remaining > max_patterns)
+    {
+        /* Build a tree of the remaining patterns */
+        uint32_t item_count = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (replacement [i] == i)
+            {
+                tree->items [item_count++] = i;
+            }
+            merged_this_round [i] = false;
+        }
+        tree->node_count = 0;
+        int32_t root = lossy_vp_build (tree, 0, item_count);
+
+        /* Find each pattern's nearest neighbour */
+        uint32_t candidate_count = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (replacement [i] != i)
+            {
+                continue;
+            }
+
+            uint32_t neighbour = i;
+            float distance = INFINITY;
+            lossy_vp_search (tree, root, i, &neighbour, &distance);
+
+            candidates [candidate_count++] = (lossy_candidate_t) {
+                .item = i,
+                .neighbour = neighbour,
+                .cost = distance * weights [i]
+            };
+        }
+        qsort (candidates, candidate_count, sizeof (lossy_candidate_t), lossy_candidate_compare);
+
+        /* Merge the cheapest pairs */
+        for (uint32_t i = 0; i < candidate_count && remaining > max_patterns; i++)
+        {
+            uint32_t item = candidates [i].item;
+            uint32_t neighbour = candidates [i].neighbour;
+
+            if (merged_this_round [item] || replacement [neighbour] != neighbour)
+            {
+                continue;
+            }
+
+            replacement [item] = neighbour;
+            weights [neighbour] += weights [item];
+            merged_this_round [neighbour] = true;
+            remaining--;
+        }
+    }
+
+    /* Patterns merged into a pattern that was later merged
+     * itself should point to the final replacement */
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t target = replacement [i];
+        while (replacement [target] != target)
+        {
+            target = replacement [target];
+        }
+        replacement [i] = target;
+    }
+}
+
+
+/*
+ * Reduce a set of mode-4 patterns to at most max_patterns by merging similar patterns.
+ *
+ * patterns: count × 32-byte bitplane patterns.
+ * weights: the number of tiles using each pattern.
+ * colours: the 6-bit SMS colour of each palette entry, or LOSSY_TRANSPARENT.
+ * replacement: filled in with the pattern that each pattern should be replaced with,
+ *              which is itself for patterns that are kept.
+ */
+int lossy_reduce (const uint8_t *patterns, const uint32_t *weights, uint32_t count,
+                  const uint8_t *colours, uint32_t max_patterns, uint32_t *replacement)
+{
+    int rc = RC_OK;
+
+    pixels = calloc (count, sizeof (pixels [0]));
+    uint32_t *merged_weights = calloc (count, sizeof (uint32_t));
+    bool *merged_this_round = calloc (count, sizeof (bool));
+    lossy_candidate_t *candidates = calloc (count, sizeof (lossy_candidate_t));
+    vp_tree_t tree = {
+        .nodes = calloc (count, sizeof (vp_node_t)),
+        .items = calloc (count, sizeof (uint32_t)),
+        .distances = calloc (count, sizeof (float))
+    };
+
+    if (pixels == NULL || merged_weights == NULL || merged_this_round == NULL || candidates == NULL ||
+        tree.nodes == NULL || tree.items == NULL || tree.distances == NULL)
+    {
+        fprintf (stderr, "Error: Failed to allocate memory for lossy de-duplication.\n");
+        rc = RC_ERROR;
+    }
+
+    if (rc == RC_OK)
+    {
+        lossy_build_distance_table (colours);
+
+        /* Convert the patterns back to palette indices */
+        for (uint32_t i = 0; i < count; i++)
+        {
+            for (uint32_t y = 0; y < 8; y++)
+            {
+                for (uint32_t x = 0; x < 8; x++)
+                {
+                    uint8_t index = 0;
+                    for (uint32_t plane = 0; plane < 4; plane++)
+                    {
+                        index |= ((patterns [i * PATTERN_KEY_SIZE + y * 4 + plane] >> (7 - x)) & 0x01) << plane;
+                    }
+                    pixels [i] [y * 8 + x] = index;
+                }
+            }
+            replacement [i] = i;
+            merged_weights [i] = weights [i];
+        }
+
+        lossy_merge (&tree, candidates, merged_weights, merged_this_round, count, max_patterns, replacement);
+    }
+
+    /* Tidy up */
+    free (pixels);
+    pixels = NULL;
+    free (merged_weights);
+    free (merged_this_round);
+    free (candidates);
+    free (tree.nodes);
+    free (tree.items);
+    free (tree.distances);
+
+    return rc;
+}
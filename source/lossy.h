@@ -0,0 +1,11 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ */
+
+/* Palette entry that is displayed as transparent */
+#define LOSSY_TRANSPARENT 0xff
+
+/* Reduce a set of mode-4 patterns to at most max_patterns by merging similar patterns. */
+int lossy_reduce (const uint8_t *patterns, const uint32_t *weights, uint32_t count,
+                  const uint8_t *colours, uint32_t max_patterns, uint32_t *replacement);
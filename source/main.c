@@ -6,20 +6,18 @@
  * Sega Master System VDP, from a set of .png images.
  *
  * To Do list:
- *  - De-duplicate for tms99xx modes
  *  - Split patterns across multiple output files to work with mappers.
  *  - Make "--sprites" per-sheet. Background patterns should be able to use the extra index-0 colour.
  *
  * Consider:
  *  - Option to help automate colour-cycling
  *  - 'tall sprite mode' vertical tile ordering
- *  - De-duplicate after converting to VDP representation instead of in image-space
- *  - For mode-0, consider pre-processing the tiles into colour-groups before de-duplication / VDP representation
+ *  - For mode-0, consider pre-processing the tiles into colour-groups before generating patterns
  *  - Configuration files to describe what to do with each image rather than parameters
  *  - Dithering support for handling full-colour images
- *  - Lossy de-duplication to force an image to use at most <n> patterns
  */
 
+#include <ctype.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -30,252 +28,1250 @@
 #include <spng.h>
 
 #include "sneptile.h"
+#include "cache.h"
+#include "compress.h"
+#include "lossy.h"
+#include "output.h"
+#include "pattern_compare.h"
+#include "sheet.h"
 #include "sms_vdp.h"
 #include "tms9928a.h"
 
 /* Global State */
 target_t target = VDP_MODE_4;
 char *output_dir = NULL;
+output_format_t output_format = OUTPUT_FORMAT_C;
 image_t current_image;
 
-/* De-duplication */
-void* unique_tiles [512];
-uint32_t unique_tiles_count = 0;
+/* De-duplication pool.
+ * Tiles are de-duplicated on their VDP representation, so that two tiles
+ * are only considered unique if the VDP would display them differently.
+ * Entries are allocated in fixed-size chunks, so growing the pool never
+ * moves an existing entry. */
+#define TILE_POOL_CHUNK_SIZE 1024
+typedef struct tile_pool_entry_s {
+    uint8_t pattern [PATTERN_KEY_SIZE];
+    uint32_t hash;
+    uint32_t index; /* Pattern index to use in the name table */
+} tile_pool_entry_t;
+
+bool dedup_global = false;
+bool dedup_flips = false;
+bool dedup_tms = false;
+
+/* Program name, for the usage text */
+static const char *program_name = "Sneptile";
+
+/* Options that are followed by a value */
+static const char *value_options [] = {
+    "--output-dir", "--format", "--compress", "--cache-dir", "--jobs",
+    "--panels", "--region", "--max-patterns", "--manifest"
+};
+
+static tile_pool_entry_t **tile_pool_chunks = NULL;
+static uint32_t tile_pool_chunk_count = 0;
+static uint32_t unique_tiles_count = 0;
+
+/* Hash table of indices into the pool, -1 for an empty slot.
+ * Kept at no more than half full, so probe sequences stay short. */
+static int32_t *tile_hash_table = NULL;
+static uint32_t tile_hash_slots = 0;
 
 /* Panels */
 uint32_t panel_width = 0;
 uint32_t panel_height = 0;
 uint32_t panel_count = 0;
 
+/* Digest of the cache keys of the sheets processed so far */
+static uint64_t cache_chain = CACHE_HASH_INIT;
+
 /* Per-image settings */
 bool use_background_palette = false;
+uint32_t max_patterns = 0;
+
+/* Number of worker threads decoding sheets */
+static uint32_t jobs = 1;
+
+/* Input sheets, from the command line and any manifests */
+static sheet_t *sheets = NULL;
+static uint32_t sheet_count = 0;
+static uint32_t sheet_capacity = 0;
+
+/* Manifest contents, which the paths of their sheets point in to */
+static char **manifests = NULL;
+static uint32_t manifest_count = 0;
+
+/* How far beyond the sheet being committed to ask the kernel to read ahead */
+#define PREFETCH_DISTANCE 8
+
+/* State for committing a sheet's tiles, in command-line order */
+typedef struct sheet_commit_s {
+    sheet_t *sheet;
+    cache_entry_t *record;
+    uint32_t first_pattern;
+    uint32_t palette_start [2];
+    int16_t palette_index [65];     /* Mode-4 palette index of each sheet colour, -1 until first used */
+    uint16_t *tile_map;
+    uint32_t map_width;
+    uint32_t tile_count;
+    bool all_tiles_valid;
+
+    /* Colours of each new TMS99xx pattern, for the cache */
+    bool record_tiles;
+    uint8_t *tiles;
+    uint32_t tiles_capacity;
+} sheet_commit_t;
+
+
+/*
+ * Hash the contents of a pattern (FNV-1a).
+ */
+static uint32_t sneptile_pattern_hash (const uint8_t *pattern)
+{
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < PATTERN_KEY_SIZE; i++)
+    {
+        hash = (hash ^ pattern [i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+
+/*
+ * Get a unique pattern's entry in the pool.
+ */
+static tile_pool_entry_t *sneptile_pool_entry (uint32_t index)
+{
+    return &tile_pool_chunks [index / TILE_POOL_CHUNK_SIZE] [index % TILE_POOL_CHUNK_SIZE];
+}
+
+
+/*
+ * Look up a pattern in the hash table.
+ * Returns the pattern index of the matching unique pattern, or -1 if it is unique.
+ * If there is no match, slot is set to the empty slot where the pattern belongs.
+ */
+static int32_t sneptile_find_pattern (const uint8_t *pattern, uint32_t hash, uint32_t *slot)
+{
+    uint32_t i = hash & (tile_hash_slots - 1);
+
+    /* Linear probing, collisions are resolved with a full compare */
+    while (tile_hash_table [i] != -1)
+    {
+        tile_pool_entry_t *entry = sneptile_pool_entry (tile_hash_table [i]);
+
+        if (entry->hash == hash && sneptile_pattern_equal (pattern, entry->pattern))
+        {
+            return entry->index;
+        }
+        i = (i + 1) & (tile_hash_slots - 1);
+    }
+
+    *slot = i;
+    return -1;
+}
+
+
+/*
+ * Find the first free slot in the hash table for a pattern, without looking for a match.
+ */
+static uint32_t sneptile_find_free_slot (uint32_t hash)
+{
+    uint32_t i = hash & (tile_hash_slots - 1);
+
+    while (tile_hash_table [i] != -1)
+    {
+        i = (i + 1) & (tile_hash_slots - 1);
+    }
+
+    return i;
+}
+
+
+/*
+ * Look up a pattern, if patterns are being de-duplicated for the target.
+ * Returns -1, with the slot to add the pattern at, if a new pattern should be generated.
+ */
+static int32_t sneptile_lookup_pattern (const uint8_t *pattern, uint32_t *hash, uint32_t *slot)
+{
+    /* TMS99xx patterns are only de-duplicated when asked for. Every tile still gets a
+     * pool entry, so that the pool's count remains the number of patterns generated.
+     * As the entries are never looked up, they are hashed on their position instead,
+     * so that repeated patterns don't build up a long probe sequence. */
+    if (target != VDP_MODE_4 && target != VDP_MODE_4_SPRITES && !dedup_tms && !dedup_global)
+    {
+        *hash = unique_tiles_count * 2654435761u;
+        *slot = sneptile_find_free_slot (*hash);
+        return -1;
+    }
+
+    return sneptile_find_pattern (pattern, *hash, slot);
+}
+
+
+/*
+ * Resize the hash table, re-inserting the existing unique patterns.
+ */
+static int sneptile_hash_table_resize (uint32_t slots)
+{
+    int32_t *table = malloc (slots * sizeof (int32_t));
+    if (table == NULL)
+    {
+        return RC_ERROR;
+    }
+    memset (table, 0xff, slots * sizeof (int32_t));
+
+    for (uint32_t index = 0; index < unique_tiles_count; index++)
+    {
+        uint32_t i = sneptile_pool_entry (index)->hash & (slots - 1);
+        while (table [i] != -1)
+        {
+            i = (i + 1) & (slots - 1);
+        }
+        table [i] = index;
+    }
+
+    free (tile_hash_table);
+    tile_hash_table = table;
+    tile_hash_slots = slots;
+
+    return RC_OK;
+}
+
+
+/*
+ * Add a unique pattern to the pool, at the hash table slot found by sneptile_find_pattern.
+ * The pattern index is the value to use for the pattern in the name table.
+ */
+static int sneptile_pool_add (const uint8_t *pattern, uint32_t hash, uint32_t slot, uint32_t index)
+{
+    /* Allocate a new chunk when the existing ones are full */
+    if (unique_tiles_count == tile_pool_chunk_count * TILE_POOL_CHUNK_SIZE)
+    {
+        tile_pool_entry_t **chunks = realloc (tile_pool_chunks, (tile_pool_chunk_count + 1) * sizeof (tile_pool_entry_t *));
+        if (chunks == NULL)
+        {
+            return RC_ERROR;
+        }
+        tile_pool_chunks = chunks;
+
+        tile_pool_chunks [tile_pool_chunk_count] = malloc (TILE_POOL_CHUNK_SIZE * sizeof (tile_pool_entry_t));
+        if (tile_pool_chunks [tile_pool_chunk_count] == NULL)
+        {
+            return RC_ERROR;
+        }
+        tile_pool_chunk_count++;
+    }
+
+    tile_pool_entry_t *entry = sneptile_pool_entry (unique_tiles_count);
+    memcpy (entry->pattern, pattern, PATTERN_KEY_SIZE);
+    entry->hash = hash;
+    entry->index = index;
+    tile_hash_table [slot] = unique_tiles_count++;
+
+    /* Grow the hash table once it is half full */
+    if (unique_tiles_count * 2 >= tile_hash_slots)
+    {
+        return sneptile_hash_table_resize (tile_hash_slots * 2);
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Free the de-duplication pool.
+ */
+static void sneptile_pool_free (void)
+{
+    for (uint32_t i = 0; i < tile_pool_chunk_count; i++)
+    {
+        free (tile_pool_chunks [i]);
+    }
+    free (tile_pool_chunks);
+    tile_pool_chunks = NULL;
+    tile_pool_chunk_count = 0;
+
+    free (tile_hash_table);
+    tile_hash_table = NULL;
+    tile_hash_slots = 0;
+}
+
+
+/*
+ * Look for a flipped form of a mode-4 pattern in the pool.
+ * Returns the pattern index of the matching unique pattern with the name-table
+ * flip bits set, or -1 if no flipped form matches.
+ */
+static int32_t sneptile_find_flipped_pattern (const uint8_t *pattern)
+{
+    static const uint16_t flips [3] = { TILE_FLIP_H, TILE_FLIP_V, TILE_FLIP_H | TILE_FLIP_V };
+    uint8_t flipped [PATTERN_KEY_SIZE];
+    uint32_t slot;
+
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        /* Each line is four bytes, one per bitplane, with the leftmost pixel in the high bit */
+        for (uint32_t y = 0; y < 8; y++)
+        {
+            uint32_t src_y = (flips [i] & TILE_FLIP_V) ? 7 - y : y;
+            for (uint32_t plane = 0; plane < 4; plane++)
+            {
+                uint8_t byte = pattern [src_y * 4 + plane];
+                if (flips [i] & TILE_FLIP_H)
+                {
+                    byte = ((byte & 0xf0) >> 4) | ((byte & 0x0f) << 4);
+                    byte = ((byte & 0xcc) >> 2) | ((byte & 0x33) << 2);
+                    byte = ((byte & 0xaa) >> 1) | ((byte & 0x55) << 1);
+                }
+                flipped [y * 4 + plane] = byte;
+            }
+        }
+
+        int32_t match = sneptile_find_pattern (flipped, sneptile_pattern_hash (flipped), &slot);
+        if (match != -1)
+        {
+            return match | flips [i];
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * Reduce the patterns added by the current image to at most max_patterns, then generate them.
+ * Pool entries from first_pattern onwards belong to the current image.
+ */
+static int sneptile_lossy_reduce (uint32_t first_pattern, uint16_t *tile_map, uint32_t tile_count)
+{
+    uint32_t count = unique_tiles_count - first_pattern;
+    uint16_t flip_mask = dedup_flips ? (TILE_FLIP_H | TILE_FLIP_V) : 0;
+    int rc = RC_OK;
+
+    if (count == 0)
+    {
+        return RC_OK;
+    }
+
+    uint8_t *patterns = malloc (count * PATTERN_KEY_SIZE);
+    uint32_t *weights = calloc (count, sizeof (uint32_t));
+    uint32_t *replacement = malloc (count * sizeof (uint32_t));
+    if (patterns == NULL || weights == NULL || replacement == NULL)
+    {
+        fprintf (stderr, "Error: Failed to allocate memory for lossy de-duplication.\n");
+        rc = RC_ERROR;
+    }
+
+    if (rc == RC_OK)
+    {
+        /* Count how many tiles use each pattern */
+        for (uint32_t i = 0; i < count; i++)
+        {
+            memcpy (&patterns [i * PATTERN_KEY_SIZE], sneptile_pool_entry (first_pattern + i)->pattern, PATTERN_KEY_SIZE);
+            replacement [i] = i;
+        }
+        for (uint32_t i = 0; i < tile_count; i++)
+        {
+            uint32_t index = tile_map [i] & ~flip_mask;
+            if (index >= first_pattern && index < unique_tiles_count)
+            {
+                weights [index - first_pattern]++;
+            }
+        }
+
+        if (count > max_patterns)
+        {
+            palette_t palette = use_background_palette ? PALETTE_BACKGROUND : PALETTE_SPRITE;
+            uint8_t colours [16];
+
+            mode4_palette_get_colours (palette, colours);
+            if (target == VDP_MODE_4_SPRITES)
+            {
+                colours [0] = LOSSY_TRANSPARENT;
+            }
+
+            rc = lossy_reduce (patterns, weights, count, colours, max_patterns, replacement);
+        }
+    }
+
+    if (rc == RC_OK)
+    {
+        /* Rebuild the pool without the current image's patterns */
+        unique_tiles_count = first_pattern;
+        rc = sneptile_hash_table_resize (tile_hash_slots);
+    }
+
+    if (rc == RC_OK)
+    {
+        /* Generate the patterns that have been kept, re-using weights for their new indices */
+        for (uint32_t i = 0; i < count && rc == RC_OK; i++)
+        {
+            if (replacement [i] != i)
+            {
+                continue;
+            }
+
+            uint8_t *pattern = &patterns [i * PATTERN_KEY_SIZE];
+            uint32_t hash = sneptile_pattern_hash (pattern);
+            uint32_t slot;
+
+            int32_t index = sneptile_find_pattern (pattern, hash, &slot);
+            if (index == -1)
+            {
+                index = mode4_process_tile (pattern);
+                rc = sneptile_pool_add (pattern, hash, slot, index);
+            }
+            weights [i] = index;
+        }
+
+        /* Update the tile map to use the kept patterns */
+        for (uint32_t i = 0; i < tile_count; i++)
+        {
+            uint32_t index = tile_map [i] & ~flip_mask;
+            if (index >= first_pattern && index < first_pattern + count)
+            {
+                tile_map [i] = weights [replacement [index - first_pattern]] | (tile_map [i] & flip_mask);
+            }
+        }
+    }
+
+    free (patterns);
+    free (weights);
+    free (replacement);
+
+    return rc;
+}
+
+
+/*
+ * Mark the start of a new image, and reset the de-duplication pool.
+ */
+static int sneptile_new_image (const char *name)
+{
+    switch (target)
+    {
+        case VDP_MODE_0:
+        case VDP_MODE_2:
+        case VDP_MODE_TMS_SMALL_SPRITES:
+        case VDP_MODE_TMS_LARGE_SPRITES:
+            tms9928a_new_input_file (name);
+            break;
+        case VDP_MODE_4:
+        case VDP_MODE_4_SPRITES:
+            if (mode4_new_input_file (name) != RC_OK)
+            {
+                return RC_ERROR;
+            }
+            break;
+        default:
+            break;
+    }
+
+    /* Reset the unique tiles counter and hash table.
+     * Unless --dedup-global is used, de-duplication is only performed within a file. */
+    if (tile_hash_table == NULL)
+    {
+        if (sneptile_hash_table_resize (1024) != RC_OK)
+        {
+            fprintf (stderr, "Error: Failed to allocate de-duplication table.\n");
+            return RC_ERROR;
+        }
+    }
+    else if (!dedup_global)
+    {
+        unique_tiles_count = 0;
+        memset (tile_hash_table, 0xff, tile_hash_slots * sizeof (int32_t));
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Write the indices or panels for an image.
+ */
+static int sneptile_write_indices (const char *name, uint16_t *tile_map)
+{
+    /* Name-table entries only have nine bits for the pattern index */
+    if (dedup_flips && unique_tiles_count > 512)
+    {
+        fprintf (stderr, "Error: %s uses more than 512 patterns, which cannot be flipped in the name table.\n", name);
+        return RC_ERROR;
+    }
+
+    if (panel_count)
+    {
+        switch (target)
+        {
+            case VDP_MODE_4:
+            case VDP_MODE_4_SPRITES:
+                return mode4_process_panels (name, panel_count, panel_width, panel_height, tile_map);
+            default:
+                break;
+        }
+    }
+    else
+    {
+        switch (target)
+        {
+            case VDP_MODE_0:
+            case VDP_MODE_2:
+            case VDP_MODE_TMS_SMALL_SPRITES:
+            case VDP_MODE_TMS_LARGE_SPRITES:
+                return tms9928a_process_indices (name, tile_map);
+            case VDP_MODE_4:
+            case VDP_MODE_4_SPRITES:
+                return mode4_process_indices (name, tile_map);
+            default:
+                break;
+        }
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Record the result of processing an image, for the cache.
+ * Pool entries from first_pattern onwards belong to the image.
+ * For the TMS99xx modes, tiles holds the colours of each new pattern.
+ * On success, the record takes ownership of the tile map and tiles.
+ */
+static int sneptile_cache_record (cache_entry_t *record, uint32_t first_pattern, const uint32_t *palette_start,
+                                  uint16_t *tile_map, uint8_t *tiles)
+{
+    uint32_t tile_size = sheet_tile_size ();
+    uint32_t palette_end [2] = { mode4_palette_size (PALETTE_BACKGROUND), mode4_palette_size (PALETTE_SPRITE) };
+
+    /* An overflowing palette is an error when the output files are closed, don't cache it */
+    if (palette_end [0] > 16 || palette_end [1] > 16)
+    {
+        return RC_ERROR;
+    }
+
+    memset (record, 0, sizeof (cache_entry_t));
+    record->width = current_image.width;
+    record->height = current_image.height;
+    record->tile_count = (current_image.width / tile_size) * (current_image.height / tile_size);
+    record->pattern_count = unique_tiles_count - first_pattern;
+
+    for (uint32_t palette = 0; palette < 2; palette++)
+    {
+        uint8_t colours [16];
+        mode4_palette_get_colours (palette, colours);
+        record->palette_added_count [palette] = palette_end [palette] - palette_start [palette];
+        memcpy (record->palette_added [palette], &colours [palette_start [palette]], record->palette_added_count [palette]);
+    }
+
+    record->patterns = malloc (record->pattern_count * PATTERN_KEY_SIZE);
+    record->pattern_indices = malloc (record->pattern_count * sizeof (uint32_t));
+    if (record->patterns == NULL || record->pattern_indices == NULL)
+    {
+        cache_entry_free (record);
+        return RC_ERROR;
+    }
+
+    for (uint32_t i = 0; i < record->pattern_count; i++)
+    {
+        tile_pool_entry_t *entry = sneptile_pool_entry (first_pattern + i);
+        memcpy (&record->patterns [i * PATTERN_KEY_SIZE], entry->pattern, PATTERN_KEY_SIZE);
+        record->pattern_indices [i] = entry->index;
+    }
+
+    /* The TMS99xx patterns are generated from colours rather than from the key */
+    if (target != VDP_MODE_4 && target != VDP_MODE_4_SPRITES)
+    {
+        record->tile_size = tile_size;
+        record->tiles = tiles;
+    }
+
+    record->tile_map = tile_map;
+
+    return RC_OK;
+}
+
+
+/*
+ * Re-create the output for an image from its cache entry, without decoding it.
+ */
+static int sneptile_replay_image (cache_entry_t *entry, char *name)
+{
+    uint32_t tile_pixels = entry->tile_size * entry->tile_size;
+
+    current_image.width = entry->width;
+    current_image.height = entry->height;
+
+    if (sneptile_new_image (name) != RC_OK)
+    {
+        return RC_ERROR;
+    }
+
+    for (uint32_t palette = 0; palette < 2; palette++)
+    {
+        for (uint32_t i = 0; i < entry->palette_added_count [palette]; i++)
+        {
+            mode4_palette_add_colour (palette, entry->palette_added [palette] [i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < entry->pattern_count; i++)
+    {
+        uint8_t *pattern = &entry->patterns [i * PATTERN_KEY_SIZE];
+        uint32_t hash = sneptile_pattern_hash (pattern);
+        int32_t index = -1;
+        uint32_t slot;
+
+        if (sneptile_lookup_pattern (pattern, &hash, &slot) != -1)
+        {
+            fprintf (stderr, "Error: Cache entry for %s does not match the earlier sheets.\n", name);
+            return RC_ERROR;
+        }
+
+        switch (target)
+        {
+            case VDP_MODE_0:
+            case VDP_MODE_2:
+            case VDP_MODE_TMS_SMALL_SPRITES:
+            case VDP_MODE_TMS_LARGE_SPRITES:
+                if (tile_pixels != 0)
+                {
+                    index = tms9928a_process_tile (&entry->tiles [i * tile_pixels]);
+                }
+                break;
+            case VDP_MODE_4:
+            case VDP_MODE_4_SPRITES:
+                index = mode4_process_tile (pattern);
+                break;
+            default:
+                break;
+        }
+
+        if (index != (int32_t) entry->pattern_indices [i])
+        {
+            fprintf (stderr, "Error: Cache entry for %s does not match the earlier sheets.\n", name);
+            return RC_ERROR;
+        }
+
+        if (sneptile_pool_add (pattern, hash, slot, index) != RC_OK)
+        {
+            fprintf (stderr, "Error: Failed to allocate de-duplication pool.\n");
+            return RC_ERROR;
+        }
+    }
+
+    return sneptile_write_indices (name, entry->tile_map);
+}
+
+
+/*
+ * Start committing a sheet's tiles.
+ */
+static int sneptile_commit_begin (sheet_commit_t *commit, sheet_t *sheet, cache_entry_t *record)
+{
+    uint32_t tile_size = sheet_tile_size ();
+
+    memset (commit, 0, sizeof (sheet_commit_t));
+    commit->sheet = sheet;
+    commit->record = record;
+    commit->record_tiles = (record != NULL) && target != VDP_MODE_4 && target != VDP_MODE_4_SPRITES;
+    commit->palette_start [0] = mode4_palette_size (PALETTE_BACKGROUND);
+    commit->palette_start [1] = mode4_palette_size (PALETTE_SPRITE);
+    commit->all_tiles_valid = true;
+    memset (commit->palette_index, 0xff, sizeof (commit->palette_index));
+
+    current_image.width = sheet->width;
+    current_image.height = sheet->height;
+
+    if (sneptile_new_image (sheet->name) != RC_OK)
+    {
+        return RC_ERROR;
+    }
+
+    /* Sanity check */
+    if ((current_image.width % tile_size != 0) || (current_image.height % tile_size != 0))
+    {
+        fprintf (stderr, "Error: Invalid resolution %ux%u\n", current_image.width, current_image.height);
+        return RC_ERROR;
+    }
+
+    commit->first_pattern = unique_tiles_count;
+
+    /* Record the pattern index of each tile as it is de-duplicated,
+     * for use when generating the indices arrays */
+    commit->map_width = current_image.width / tile_size;
+    commit->tile_map = calloc (commit->map_width * (current_image.height / tile_size), sizeof (uint16_t));
+    if (commit->tile_map == NULL)
+    {
+        fprintf (stderr, "Error: Failed to allocate tile map.\n");
+        return RC_ERROR;
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Commit the next tile of a sheet, given as sheet colours.
+ */
+static int sneptile_commit_tile (void *context, const uint8_t *sheet_colours)
+{
+    sheet_commit_t *commit = context;
+    uint32_t tile_size = sheet_tile_size ();
+    uint32_t tile_pixels = tile_size * tile_size;
+    uint16_t *map_entry = &commit->tile_map [commit->tile_count++];
+    uint8_t colours [16 * 16];
+    uint8_t pattern [PATTERN_KEY_SIZE];
+    int32_t index = -1;
+    uint32_t hash;
+    uint32_t slot;
+
+    /* Convert the tile to the VDP representation used for de-duplication. For mode-4,
+     * each sheet colour is added to the palette the first time it is used, so colours
+     * are added in the order that they first appear. */
+    switch (target)
+    {
+        case VDP_MODE_0:
+        case VDP_MODE_2:
+        case VDP_MODE_TMS_SMALL_SPRITES:
+        case VDP_MODE_TMS_LARGE_SPRITES:
+            for (uint32_t i = 0; i < tile_pixels; i++)
+            {
+                colours [i] = tms9928a_check_colour (sheet_colours [i]);
+            }
+            tms9928a_tile_to_key (colours, pattern);
+            break;
+        case VDP_MODE_4:
+        case VDP_MODE_4_SPRITES:
+            for (uint32_t i = 0; i < tile_pixels; i++)
+            {
+                uint8_t colour = sheet_colours [i];
+                int16_t index = commit->palette_index [colour];
+                if (index == -1)
+                {
+                    index = (colour == 0) ? 0 :
+                        mode4_colour_to_index ((use_background_palette) ? PALETTE_BACKGROUND : PALETTE_SPRITE,
+                                               commit->sheet->colours [colour - 1]);
+
+                    /* Sprite lookups never match index 0, so a visible colour given index 0 by an
+                     * empty palette is looked up again for its next pixel, as with RGBA sheets */
+                    if (index != 0 || target != VDP_MODE_4_SPRITES)
+                    {
+                        commit->palette_index [colour] = index;
+                    }
+                }
+                colours [i] = index;
+            }
+            mode4_indices_to_pattern (colours, pattern);
+            break;
+        default:
+            break;
+    }
+
+    hash = sneptile_pattern_hash (pattern);
+    index = sneptile_lookup_pattern (pattern, &hash, &slot);
+    if (index == -1 && target == VDP_MODE_4 && dedup_flips)
+    {
+        index = sneptile_find_flipped_pattern (pattern);
+    }
+    if (index != -1)
+    {
+        *map_entry = index;
+        return RC_OK;
+    }
+
+    /* Generate the new pattern */
+    switch (target)
+    {
+        case VDP_MODE_0:
+        case VDP_MODE_2:
+        case VDP_MODE_TMS_SMALL_SPRITES:
+        case VDP_MODE_TMS_LARGE_SPRITES:
+            index = tms9928a_process_tile (colours);
+            break;
+        case VDP_MODE_4:
+        case VDP_MODE_4_SPRITES:
+            /* With a pattern budget, patterns are generated after the lossy stage */
+            index = (max_patterns != 0) ? (int32_t) unique_tiles_count : mode4_process_tile (pattern);
+            break;
+        default:
+            break;
+    }
+    *map_entry = index;
+
+    /* Tiles that could not be converted are not added to the pool */
+    if (index == -1)
+    {
+        commit->all_tiles_valid = false;
+        return RC_OK;
+    }
+
+    if (sneptile_pool_add (pattern, hash, slot, index) != RC_OK)
+    {
+        fprintf (stderr, "Error: Failed to allocate de-duplication pool.\n");
+        return RC_ERROR;
+    }
+
+    /* Keep the colours of new TMS99xx patterns for the cache */
+    if (commit->record_tiles)
+    {
+        uint32_t count = unique_tiles_count - commit->first_pattern;
+        if (count > commit->tiles_capacity)
+        {
+            commit->tiles_capacity = (commit->tiles_capacity == 0) ? 64 : commit->tiles_capacity * 2;
+            uint8_t *tiles = realloc (commit->tiles, commit->tiles_capacity * tile_pixels);
+            if (tiles == NULL)
+            {
+                /* Without the tiles, the image is not cached */
+                free (commit->tiles);
+                commit->tiles = NULL;
+                commit->record_tiles = false;
+                return RC_OK;
+            }
+            commit->tiles = tiles;
+        }
+        memcpy (&commit->tiles [(count - 1) * tile_pixels], colours, tile_pixels);
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Finish committing a sheet, and write its indices.
+ * If the commit was started with a record, the result is recorded for the cache.
+ */
+static int sneptile_commit_end (sheet_commit_t *commit)
+{
+    uint32_t tile_size = sheet_tile_size ();
+
+    if ((target == VDP_MODE_4 || target == VDP_MODE_4_SPRITES) && max_patterns != 0)
+    {
+        if (sneptile_lossy_reduce (commit->first_pattern, commit->tile_map,
+                                   commit->map_width * (current_image.height / tile_size)) != RC_OK)
+        {
+            fprintf (stderr, "Error: Failed to reduce patterns for %s.\n", commit->sheet->name);
+            return RC_ERROR;
+        }
+    }
+
+    if (sneptile_write_indices (commit->sheet->name, commit->tile_map) != RC_OK)
+    {
+        return RC_ERROR;
+    }
+
+    /* Sheets with invalid tiles are not cached, so that their errors are reported on every run */
+    if (commit->record != NULL && commit->all_tiles_valid &&
+        (commit->record_tiles || target == VDP_MODE_4 || target == VDP_MODE_4_SPRITES) &&
+        sneptile_cache_record (commit->record, commit->first_pattern, commit->palette_start,
+                               commit->tile_map, commit->tiles) == RC_OK)
+    {
+        commit->tile_map = NULL;
+        commit->tiles = NULL;
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Get the cache key for the state left by earlier sheets that a sheet's result depends on.
+ */
+static uint64_t sneptile_cache_state_key (void)
+{
+    uint32_t palette_sizes [2] = { mode4_palette_size (PALETTE_BACKGROUND), mode4_palette_size (PALETTE_SPRITE) };
+    uint8_t palettes [2] [16];
+    uint64_t key;
+
+    mode4_palette_get_colours (PALETTE_BACKGROUND, palettes [0]);
+    mode4_palette_get_colours (PALETTE_SPRITE, palettes [1]);
+
+    key = cache_hash (CACHE_HASH_INIT, palette_sizes, sizeof (palette_sizes));
+    key = cache_hash (key, palettes, sizeof (palettes));
+
+    /* With --dedup-global, and for the TMS99xx modes, pattern indices
+     * and de-duplication carry over from the earlier sheets */
+    if (dedup_global || (target != VDP_MODE_4 && target != VDP_MODE_4_SPRITES))
+    {
+        key = cache_hash (key, &cache_chain, sizeof (cache_chain));
+    }
+
+    return key;
+}
+
+
+/*
+ * Process a sheet that has been read, and may have been decoded ahead by a worker.
+ * Sheets are always processed in command-line order.
+ */
+static int sneptile_process_sheet (sheet_t *sheet)
+{
+    cache_entry_t cache_entry = { };
+    uint64_t state_key = 0;
+    sheet_commit_t commit = { };
+    int rc = RC_OK;
+
+    /* Errors from reading the file */
+    if (!sheet->read)
+    {
+        fprintf (stderr, "%s", sheet->error);
+        return RC_ERROR;
+    }
+
+    /* Per-image settings */
+    use_background_palette = sheet->use_background_palette;
+    panel_width = sheet->panel_width;
+    panel_height = sheet->panel_height;
+    panel_count = sheet->panel_count;
+    max_patterns = sheet->max_patterns;
+
+    /* If the sheet has been processed before, re-use the result */
+    if (cache_dir != NULL)
+    {
+        state_key = sneptile_cache_state_key ();
+        cache_chain = cache_hash (cache_chain, &sheet->key, sizeof (sheet->key));
+        cache_chain = cache_hash (cache_chain, &state_key, sizeof (state_key));
+
+        if (cache_load (sheet->key, state_key, &cache_entry) == RC_OK)
+        {
+            rc = sneptile_replay_image (&cache_entry, sheet->name);
+            cache_entry_free (&cache_entry);
+            if (rc != RC_OK)
+            {
+                fprintf (stderr, "Error: Failed to process image %s.\n", sheet->name);
+            }
+            return rc;
+        }
+    }
+
+    /* With a cache, the tiles are decoded in full so that they can be kept for later runs */
+    if (cache_dir != NULL && sheet->tiles == NULL && sheet->error [0] == '\0')
+    {
+        sheet_decode_tiles (sheet);
+    }
 
+    if (sheet->tiles != NULL)
+    {
+        /* Decoded ahead by a worker, or taken from the cache */
+        uint32_t tile_size = sheet_tile_size ();
+        uint32_t tile_count = (sheet->width / tile_size) * (sheet->height / tile_size);
 
-/*
- * Check if two 8x8 tiles are identical.
- * Note: Currently the two tiles must be within the same image file.
- */
-static bool sneptile_check_match (pixel_t *tile_a, pixel_t *tile_b)
-{
-    for (uint32_t row = 0; row < 8; row++)
+        rc = sneptile_commit_begin (&commit, sheet, (cache_dir != NULL) ? &cache_entry : NULL);
+        for (uint32_t i = 0; i < tile_count && rc == RC_OK; i++)
+        {
+            rc = sneptile_commit_tile (&commit, &sheet->tiles [i * tile_size * tile_size]);
+        }
+    }
+    else if (sheet->error [0] == '\0')
     {
-        if (memcmp (&tile_a [row * current_image.width],
-                    &tile_b [row * current_image.width], sizeof (pixel_t) * 8) != 0)
+        /* Decode the sheet now, committing each tile as it is decoded */
+        rc = sheet_open (sheet);
+        if (rc == RC_OK)
         {
-            return false;
+            rc = sneptile_commit_begin (&commit, sheet, (cache_dir != NULL) ? &cache_entry : NULL);
         }
+        if (rc == RC_OK)
+        {
+            rc = sheet_decode (sheet, sneptile_commit_tile, &commit);
+        }
+        sheet_close (sheet);
+    }
+    else
+    {
+        rc = RC_ERROR;
+    }
+
+    if (rc == RC_OK)
+    {
+        rc = sneptile_commit_end (&commit);
+    }
+
+    if (rc != RC_OK)
+    {
+        fprintf (stderr, "%sError: Failed to process image %s.\n", sheet->error, sheet->name);
     }
 
-    return true;
+    /* Only a sheet that could be recorded has a tile map */
+    if (rc == RC_OK && cache_entry.tile_map != NULL)
+    {
+        cache_store (sheet->key, state_key, &cache_entry);
+    }
+
+    cache_entry_free (&cache_entry);
+    free (commit.tile_map);
+    free (commit.tiles);
+
+    return rc;
 }
 
 
+static int sneptile_read_manifest (const char *path, sheet_t *options);
+
+
 /*
- * Find the matching 8x8 tile, or -1 if it is unique.
+ * Print the command line options.
  */
-int32_t sneptile_get_match (pixel_t *tile)
+static void sneptile_usage (void)
 {
-    for (uint32_t i = 0; i < unique_tiles_count; i++)
-    {
-        if (sneptile_check_match (tile, unique_tiles [i]))
-            return i;
-    }
-    return -1;
+    fprintf (stderr, "Usage: %s [global options] [per-sheet options, tiles.png]\n", program_name);
+    fprintf (stderr, "  Global options:\n");
+    fprintf (stderr, "    --mode-0 : Generate TMS99xx mode-0 patterns\n");
+    fprintf (stderr, "    --mode-2 : Generate TMS99xx mode-2 patterns\n");
+    fprintf (stderr, "    --tms-small-sprites : Generate TMS99xx sprite patterns (8x8)\n");
+    fprintf (stderr, "    --tms-large-sprites : Generate TMS99xx sprite patterns (16x16)\n");
+    fprintf (stderr, "    --de-duplicate : Within an input file, don't generate the same pattern twice (always on for mode-4)\n");
+    fprintf (stderr, "    --dedup-global : De-duplicate patterns across all input files, not just within each file\n");
+    fprintf (stderr, "    --output-dir <dir> : Specify output directory\n");
+    fprintf (stderr, "    --format <c|bin> : Write C arrays (default), or raw VDP data with headers giving the sizes\n");
+    fprintf (stderr, "    --compress <planes|zx7> : Also write each sheet's patterns compressed with the codec (mode-4)\n");
+    fprintf (stderr, "    --cache-dir <dir> : Re-use the results for sheets that have not changed since an earlier run\n");
+    fprintf (stderr, "    --cache-verify : Check cached decoded sheets against a hash of their contents, not just mtime and size\n");
+    fprintf (stderr, "    --jobs <n> : Decode sheets on <n> worker threads\n");
+    fprintf (stderr, "    --trusted-input : Don't verify the CRC and Adler-32 checksums of the input files\n");
+    fprintf (stderr, "  Mode-4 options:\n");
+    fprintf (stderr, "    --dedup-flips : Also match horizontally and vertically flipped patterns, using the name-table flip bits.\n");
+    fprintf (stderr, "    --sprite-palette <0x00 0x01..> : Pre-defined palette entries for the sprite palette.\n");
+    fprintf (stderr, "    --background-palette <0x00 0x01..> : Pre-defined palette entries for the background palette.\n");
+    fprintf (stderr, "    --sprites : Don't use index 0 for visible colours.\n");
+    fprintf (stderr, "    --compress-indices : Also write each sheet's indices run-length encoded, for faster name-table loading.\n");
+    fprintf (stderr, "  Per-sheet options:\n");
+    fprintf (stderr, "    --background : The next sheet should use the background palette instead of the sprite palette (mode-4)\n");
+    fprintf (stderr, "    --panels <wxh,n> : The following sheet contains <n> panels of size <w> x <h>. Depends on de-duplication.\n");
+    fprintf (stderr, "    --max-patterns <n> : Merge the most similar patterns until the next sheet uses at most <n> new patterns (mode-4)\n");
+    fprintf (stderr, "    --region <x,y,w,h> : Only use the <w> x <h> tiles starting at tile <x>,<y> of the next sheet\n");
+    fprintf (stderr, "    --manifest <file> : Read per-sheet options and sheets from <file>, or from stdin if <file> is -\n");
 }
 
 
 /*
- * Process an image made up of 8×8 tiles.
+ * Check that an option that takes a value is not the last argument.
+ * Prints the usage if the value is missing.
  */
-static int sneptile_process_image (pixel_t *buffer, char *name)
+static int sneptile_check_value (const char *option, bool has_value)
 {
-    uint32_t tile_width = 8;
-    uint32_t tile_height = 8;
-
-    switch (target)
+    for (uint32_t i = 0; i < sizeof (value_options) / sizeof (value_options [0]); i++)
     {
-        case VDP_MODE_0:
-        case VDP_MODE_2:
-        case VDP_MODE_TMS_SMALL_SPRITES:
-            tms9928a_new_input_file (name);
-            break;
-        case VDP_MODE_TMS_LARGE_SPRITES:
-            tile_width = 16;
-            tile_height = 16;
-            tms9928a_new_input_file (name);
-            break;
-        case VDP_MODE_4:
-        case VDP_MODE_4_SPRITES:
-            mode4_new_input_file (name);
-            break;
-        default:
-            break;
+        if (strcmp (option, value_options [i]) == 0 && !has_value)
+        {
+            fprintf (stderr, "Error: %s needs a value.\n", option);
+            sneptile_usage ();
+            return RC_ERROR;
+        }
     }
 
-    /* Sanity check */
-    if ((current_image.width % tile_width != 0) || (current_image.height % tile_height != 0))
-    {
-        fprintf (stderr, "Error: Invalid resolution %ux%u\n", current_image.width, current_image.height);
-        return -1;
-    }
+    return RC_OK;
+}
 
-    /* Reset the unique tiles counter.
-     * Note that de-duplication is only performed within a file, not across files. */
-    unique_tiles_count = 0;
 
-    for (uint32_t row = 0; row < current_image.height; row += tile_height)
+/*
+ * Add sheets from a list of per-sheet options and paths, from the command line or a manifest.
+ * Per-sheet options apply to the next path in the list.
+ */
+static int sneptile_add_sheets (int argc, char **argv, sheet_t *options, bool in_manifest)
+{
+    for (int i = 0; i < argc; i++)
     {
-        for (uint32_t col = 0; col < current_image.width; col += tile_width)
+        if (sneptile_check_value (argv [i], i + 1 < argc) != RC_OK)
         {
+            return RC_ERROR;
+        }
 
-            if ((target == VDP_MODE_4 || target == VDP_MODE_4_SPRITES) && unique_tiles_count < 512)
+        if (strcmp (argv [i], "--background") == 0)
+        {
+            options->use_background_palette = true;
+        }
+        else if (strcmp (argv [i], "--panels") == 0)
+        {
+            unsigned int width, height, count;
+            if (sscanf (argv [++i], "%ux%u,%u", &width, &height, &count) != 3 || width == 0 || height == 0 || count == 0)
             {
-                if (sneptile_get_match (&buffer [row * current_image.width + col]) == -1)
-                {
-                    unique_tiles [unique_tiles_count++] = &buffer [row * current_image.width + col];
-                }
-                else
-                {
-                    continue;
-                }
+                fprintf (stderr, "Error: --panels must be given as wxh,n, with a non-zero size and count.\n");
+                sneptile_usage ();
+                return RC_ERROR;
             }
-
-            switch (target)
+            options->panel_width = width;
+            options->panel_height = height;
+            options->panel_count = count;
+        }
+        else if (strcmp (argv [i], "--region") == 0)
+        {
+            unsigned int x, y, width, height;
+            if (sscanf (argv [++i], "%u,%u,%u,%u", &x, &y, &width, &height) != 4 || width == 0 || height == 0)
             {
-                case VDP_MODE_0:
-                case VDP_MODE_2:
-                case VDP_MODE_TMS_SMALL_SPRITES:
-                case VDP_MODE_TMS_LARGE_SPRITES:
-                    tms9928a_process_tile (&buffer [row * current_image.width + col]);
-                    break;
-                case VDP_MODE_4:
-                case VDP_MODE_4_SPRITES:
-                    mode4_process_tile ((use_background_palette) ? PALETTE_BACKGROUND : PALETTE_SPRITE,
-                                        &buffer [row * current_image.width + col]);
-                    break;
-                default:
-                    break;
+                fprintf (stderr, "Error: --region must be given as x,y,w,h in tiles, with a non-zero size.\n");
+                return RC_ERROR;
             }
+            options->region_x = x;
+            options->region_y = y;
+            options->region_width = width;
+            options->region_height = height;
         }
-    }
-
-    if (panel_count)
-    {
-        switch (target)
+        else if (strcmp (argv [i], "--max-patterns") == 0)
         {
-            case VDP_MODE_4:
-            case VDP_MODE_4_SPRITES:
-                mode4_process_panels (name, panel_count, panel_width, panel_height, buffer);
-            default:
-                break;
+            options->max_patterns = strtoul (argv [++i], NULL, 10);
+            if (options->max_patterns == 0)
+            {
+                fprintf (stderr, "Error: --max-patterns must be at least one.\n");
+                return RC_ERROR;
+            }
+            if (target != VDP_MODE_4 && target != VDP_MODE_4_SPRITES)
+            {
+                fprintf (stderr, "Warning: --max-patterns is only supported for mode-4.\n");
+            }
         }
-    }
-    else
-    {
-        switch (target)
+        else if (strcmp (argv [i], "--manifest") == 0)
         {
-            case VDP_MODE_4:
-            case VDP_MODE_4_SPRITES:
-                mode4_process_indices (name, buffer);
-            default:
-                break;
+            if (in_manifest)
+            {
+                fprintf (stderr, "Error: A manifest cannot list another manifest.\n");
+                return RC_ERROR;
+            }
+            if (sneptile_read_manifest (argv [++i], options) != RC_OK)
+            {
+                return RC_ERROR;
+            }
+        }
+        else
+        {
+            if (sheet_count == sheet_capacity)
+            {
+                uint32_t new_capacity = (sheet_capacity == 0) ? 64 : sheet_capacity * 2;
+                sheet_t *new_sheets = realloc (sheets, new_capacity * sizeof (sheet_t));
+                if (new_sheets == NULL)
+                {
+                    fprintf (stderr, "Error: Failed to allocate sheet list.\n");
+                    return RC_ERROR;
+                }
+                sheets = new_sheets;
+                sheet_capacity = new_capacity;
+            }
+
+            sheet_t *sheet = &sheets [sheet_count++];
+            *sheet = *options;
+            sheet->path = argv [i];
+
+            /* Drop the path and use only the file name */
+            sheet->name = (strrchr (argv [i], '/') != NULL) ? strrchr (argv [i], '/') + 1 : argv [i];
+
+            /* Restore per-image settings back to their defaults */
+            memset (options, 0, sizeof (sheet_t));
         }
     }
 
-    return 0;
+    return RC_OK;
 }
 
 
 /*
- * Process a single .png file.
+ * Add the sheets listed in a manifest, or on stdin if the path is "-".
+ * A manifest holds the same per-sheet options and paths as the command line, separated
+ * by whitespace, so each sheet can go on its own line. Text after a '#' is a comment.
  */
-static int sneptile_process_file (char *name)
+static int sneptile_read_manifest (const char *path, sheet_t *options)
 {
-    spng_ctx *spng_context = spng_ctx_new (0);
+    FILE *manifest_file = (strcmp (path, "-") == 0) ? stdin : fopen (path, "r");
+    char *text = NULL;
+    size_t text_size = 0;
+    size_t text_capacity = 0;
+    int rc = RC_OK;
 
-    /* Try to open the file */
-    FILE *png_file = fopen (name, "r");
-    if (png_file == NULL)
+    if (manifest_file == NULL)
     {
-        fprintf (stderr, "Error: Unable to open %s.\n", name);
+        fprintf (stderr, "Error: Unable to open manifest %s.\n", path);
         return RC_ERROR;
     }
 
-    /* Once the file has been opened, drop the path and use only the file name */
-    if (strrchr (name, '/') != NULL)
+    /* Read the whole manifest, the sheet paths point in to it */
+    do
     {
-        name = strrchr (name, '/') + 1;
-    }
-
-    /* Get the file size */
-    uint32_t png_size = 0;
-    fseek (png_file, 0, SEEK_END);
-    png_size = ftell (png_file);
-    rewind (png_file);
+        if (text_capacity - text_size < 4096)
+        {
+            text_capacity = (text_capacity == 0) ? 65536 : text_capacity * 2;
+            char *new_text = realloc (text, text_capacity);
+            if (new_text == NULL)
+            {
+                fprintf (stderr, "Error: Failed to allocate memory for manifest %s.\n", path);
+                rc = RC_ERROR;
+                break;
+            }
+            text = new_text;
+        }
+        text_size += fread (&text [text_size], 1, text_capacity - text_size - 1, manifest_file);
+    } while (!feof (manifest_file) && !ferror (manifest_file));
 
-    /* Allocate memory for the .png file */
-    uint8_t *png_buffer = calloc (png_size, 1);
-    if (png_buffer == NULL)
+    if (rc == RC_OK && ferror (manifest_file))
     {
-        fprintf (stderr, "Error: Failed to allocate memory for %s.\n", name);
-        return RC_ERROR;
+        fprintf (stderr, "Error: Failed to read manifest %s.\n", path);
+        rc = RC_ERROR;
     }
 
-    /* Read and close the file */
-    uint32_t bytes_read = 0;
-    while (bytes_read < png_size)
+    if (manifest_file != stdin)
     {
-        bytes_read += fread (png_buffer + bytes_read, 1, png_size - bytes_read, png_file);
+        fclose (manifest_file);
     }
-    fclose (png_file);
-    png_file = NULL;
 
-    /* Get the decompressed image size */
-    size_t image_size = 0;
-    if (spng_set_png_buffer (spng_context, png_buffer, png_size) != 0)
+    char **new_manifests = (rc == RC_OK) ? realloc (manifests, (manifest_count + 1) * sizeof (char *)) : NULL;
+    if (new_manifests == NULL)
     {
-        fprintf (stderr, "Error: Failed to set file buffer for %s.\n", name);
+        free (text);
         return RC_ERROR;
     }
+    manifests = new_manifests;
+    manifests [manifest_count++] = text;
+    text [text_size] = '\0';
 
-    if (spng_decoded_image_size (spng_context, SPNG_FMT_RGBA8, &image_size) != 0)
-    {
-        fprintf (stderr, "Error: Failed to determine decompression size for %s.\n", name);
-        return RC_ERROR;
-    }
+    /* Split the text into words, in place */
+    char **words = NULL;
+    uint32_t word_count = 0;
+    uint32_t word_capacity = 0;
 
-    /* Allocate memory for the decompressed image */
-    uint8_t *image_buffer = calloc (image_size, 1);
-    if (image_buffer == NULL)
+    for (char *c = text; *c != '\0' && rc == RC_OK; )
     {
-        fprintf (stderr, "Error: Failed to allocate decompression memory for %s.\n", name);
-        return RC_ERROR;
-    }
+        if (*c == '#')
+        {
+            *c++ = '\0';
+            while (*c != '\0' && *c != '\n')
+            {
+                c++;
+            }
+        }
+        else if (isspace ((unsigned char) *c))
+        {
+            *c++ = '\0';
+        }
+        else
+        {
+            if (word_count == word_capacity)
+            {
+                word_capacity = (word_capacity == 0) ? 256 : word_capacity * 2;
+                char **new_words = realloc (words, word_capacity * sizeof (char *));
+                if (new_words == NULL)
+                {
+                    fprintf (stderr, "Error: Failed to allocate memory for manifest %s.\n", path);
+                    rc = RC_ERROR;
+                    break;
+                }
+                words = new_words;
+            }
+            words [word_count++] = c;
 
-    /* Decode the image */
-    if (spng_decode_image (spng_context, image_buffer, image_size, SPNG_FMT_RGBA8, SPNG_DECODE_TRNS) != 0)
-    {
-        fprintf (stderr, "Error: Failed to decode image %s.\n", name);
-        return RC_ERROR;
+            while (*c != '\0' && *c != '#' && !isspace ((unsigned char) *c))
+            {
+                c++;
+            }
+        }
     }
 
-    /* Process the image */
-    struct spng_ihdr header = { };
-    spng_get_ihdr(spng_context, &header);
-    current_image.width = header.width;
-    current_image.height = header.height;
-    if (sneptile_process_image ((pixel_t *) image_buffer, name) != 0)
+    if (rc == RC_OK)
     {
-        fprintf (stderr, "Error: Failed to process image %s.\n", name);
-        return RC_ERROR;
+        rc = sneptile_add_sheets (word_count, words, options, true);
     }
 
-    /* Tidy up */
-    free (png_buffer);
-    free (image_buffer);
-    spng_ctx_free (spng_context);
+    free (words);
 
-    return RC_OK;
+    return rc;
 }
 
 
@@ -286,23 +1282,11 @@ int main (int argc, char **argv)
 {
     int rc = 0;
 
+    program_name = argv [0];
+
     if (argc < 2)
     {
-        fprintf (stderr, "Usage: %s [global options] [per-sheet options, tiles.png]\n", argv [0]);
-        fprintf (stderr, "  Global options:\n");
-        fprintf (stderr, "    --mode-0 : Generate TMS99xx mode-0 patterns\n");
-        fprintf (stderr, "    --mode-2 : Generate TMS99xx mode-2 patterns\n");
-        fprintf (stderr, "    --tms-small-sprites : Generate TMS99xx sprite patterns (8x8)\n");
-        fprintf (stderr, "    --tms-large-sprites : Generate TMS99xx sprite patterns (16x16)\n");
-        fprintf (stderr, "    --de-duplicate : Within an input file, don't generate the same pattern twice\n");
-        fprintf (stderr, "    --output-dir <dir> : Specify output directory\n");
-        fprintf (stderr, "  Mode-4 options:\n");
-        fprintf (stderr, "    --sprite-palette <0x00 0x01..> : Pre-defined palette entries for the sprite palette.\n");
-        fprintf (stderr, "    --background-palette <0x00 0x01..> : Pre-defined palette entries for the background palette.\n");
-        fprintf (stderr, "    --sprites : Don't use index 0 for visible colours.\n");
-        fprintf (stderr, "  Per-sheet options:\n");
-        fprintf (stderr, "    --background : The next sheet should use the background palette instead of the sprite palette (mode-4)\n");
-        fprintf (stderr, "    --panels <wxh,n> : The following sheet contains <n> panels of size <w> x <h>. Depends on de-duplication.\n");
+        sneptile_usage ();
         return EXIT_FAILURE;
     }
     argv++;
@@ -311,13 +1295,95 @@ int main (int argc, char **argv)
 
     while (argc > 0)
     {
+        if (sneptile_check_value (argv [0], argc > 1) != RC_OK)
+        {
+            return EXIT_FAILURE;
+        }
+
         /* Common options */
-        if (strcmp (argv [0], "--output-dir") == 0 && argc > 2)
+        if (strcmp (argv [0], "--output-dir") == 0)
         {
             output_dir = argv [1];
             argv += 2;
             argc -= 2;
         }
+        else if (strcmp (argv [0], "--format") == 0)
+        {
+            if (strcmp (argv [1], "c") == 0)
+            {
+                output_format = OUTPUT_FORMAT_C;
+            }
+            else if (strcmp (argv [1], "bin") == 0)
+            {
+                output_format = OUTPUT_FORMAT_BIN;
+            }
+            else
+            {
+                fprintf (stderr, "Error: Unknown output format %s.\n", argv [1]);
+                return EXIT_FAILURE;
+            }
+            argv += 2;
+            argc -= 2;
+        }
+        else if (strcmp (argv [0], "--compress") == 0)
+        {
+            if (strcmp (argv [1], "planes") == 0)
+            {
+                compress_codecs |= COMPRESS_PLANES;
+            }
+            else if (strcmp (argv [1], "zx7") == 0)
+            {
+                compress_codecs |= COMPRESS_ZX7;
+            }
+            else
+            {
+                fprintf (stderr, "Error: Unknown compression codec %s.\n", argv [1]);
+                return EXIT_FAILURE;
+            }
+            argv += 2;
+            argc -= 2;
+        }
+        else if (strcmp (argv [0], "--cache-dir") == 0)
+        {
+            cache_dir = argv [1];
+            argv += 2;
+            argc -= 2;
+        }
+        else if (strcmp (argv [0], "--jobs") == 0)
+        {
+            jobs = strtoul (argv [1], NULL, 10);
+            if (jobs == 0)
+            {
+                fprintf (stderr, "Error: --jobs must be at least one.\n");
+                return EXIT_FAILURE;
+            }
+            argv += 2;
+            argc -= 2;
+        }
+        else if (strcmp (argv [0], "--cache-verify") == 0)
+        {
+            cache_verify = true;
+            argv += 1;
+            argc -= 1;
+        }
+        else if (strcmp (argv [0], "--trusted-input") == 0)
+        {
+            trusted_input = true;
+            argv += 1;
+            argc -= 1;
+        }
+        else if (strcmp (argv [0], "--dedup-global") == 0)
+        {
+            dedup_global = true;
+            argv += 1;
+            argc -= 1;
+        }
+        else if (strcmp (argv [0], "--de-duplicate") == 0)
+        {
+            dedup_tms = true;
+            argv += 1;
+            argc -= 1;
+        }
 
         /* TMS99xx Options */
         else if (strcmp (argv [0], "--mode-0") == 0)
@@ -352,6 +1418,18 @@ int main (int argc, char **argv)
             argv += 1;
             argc -= 1;
         }
+        else if (strcmp (argv [0], "--dedup-flips") == 0)
+        {
+            dedup_flips = true;
+            argv += 1;
+            argc -= 1;
+        }
+        else if (strcmp (argv [0], "--compress-indices") == 0)
+        {
+            compress_indices = true;
+            argv += 1;
+            argc -= 1;
+        }
         else if (strcmp (argv [0], "--sprite-palette") == 0)
         {
             while (++argv, --argc)
@@ -387,12 +1465,37 @@ int main (int argc, char **argv)
         }
     }
 
+    /* The sprite attribute table has no flip bits */
+    if (dedup_flips && target != VDP_MODE_4)
+    {
+        fprintf (stderr, "Error: --dedup-flips is only supported for mode-4 background patterns.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (compress_codecs != 0 && target != VDP_MODE_4 && target != VDP_MODE_4_SPRITES)
+    {
+        fprintf (stderr, "Error: --compress is only supported for mode-4 patterns.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (compress_indices && target != VDP_MODE_4 && target != VDP_MODE_4_SPRITES)
+    {
+        fprintf (stderr, "Error: --compress-indices is only supported for mode-4 indices.\n");
+        return EXIT_FAILURE;
+    }
+
     /* Create the output directory if one has been specified. */
     if (output_dir != NULL)
     {
         mkdir (output_dir, S_IRWXU);
     }
 
+    /* Create the cache directory if one has been specified. */
+    if (cache_dir != NULL)
+    {
+        mkdir (cache_dir, S_IRWXU);
+    }
+
     /* Open the output files */
     switch (target)
     {
@@ -412,35 +1515,68 @@ int main (int argc, char **argv)
 
     if (rc == RC_OK)
     {
-        for (uint32_t i = 0; i < argc; i++)
+        sheet_t options = { };
+        rc = sneptile_add_sheets (argc, argv, &options, false);
+    }
+
+    /* Sheets are read and decoded ahead by the workers, but always committed in order */
+    if (rc == RC_OK && jobs > 1)
+    {
+        rc = sheet_workers_start (sheets, sheet_count, jobs);
+    }
+
+    /* Ask the kernel to start reading the files beyond those the workers have reached */
+    uint32_t prefetch_distance = PREFETCH_DISTANCE + ((jobs > 1) ? jobs * 2 : 0);
+    uint32_t next_prefetch = 0;
+
+    for (uint32_t i = 0; i < sheet_count && rc == RC_OK; i++)
+    {
+        sheet_t *sheet = &sheets [i];
+
+        for (; next_prefetch < sheet_count && next_prefetch <= i + prefetch_distance; next_prefetch++)
         {
-            if (strcmp (argv [i], "--background") == 0)
-            {
-                use_background_palette = true;
-            }
-            else if (strcmp (argv [i], "--panels") == 0)
-            {
-                unsigned int width, height, count;
-                sscanf (argv [++i], "%ux%u,%u", &width, &height, &count);
-                panel_width = width;
-                panel_height = height;
-                panel_count = count;
-            }
-            else
-            {
-                rc = sneptile_process_file (argv [i]);
-                if (rc != RC_OK)
-                {
-                    break;
-                }
+            sheet_prefetch (&sheets [next_prefetch]);
+        }
 
-                /* Restore per-image settings back to their defaults */
-                panel_count = 0;
-                use_background_palette = false;
-            }
+        if (jobs > 1)
+        {
+            sheet_wait (i);
+        }
+        else
+        {
+            sheet_read (sheet);
+        }
+
+        rc = sneptile_process_sheet (sheet);
+
+        sheet_close (sheet);
+        sheet_free_tiles (sheet);
+
+        if (jobs > 1)
+        {
+            sheet_committed (i);
         }
     }
 
+    if (jobs > 1)
+    {
+        sheet_workers_stop ();
+    }
+
+    /* Tidy up any sheets left decoded after an error */
+    for (uint32_t i = 0; i < sheet_count; i++)
+    {
+        sheet_close (&sheets [i]);
+        sheet_free_tiles (&sheets [i]);
+    }
+    free (sheets);
+    for (uint32_t i = 0; i < manifest_count; i++)
+    {
+        free (manifests [i]);
+    }
+    free (manifests);
+    sheet_release ();
+
     if (rc == RC_OK)
     {
         /* Finalize and close the output files */
@@ -461,5 +1597,12 @@ int main (int argc, char **argv)
         }
     }
 
+    if (rc != RC_OK)
+    {
+        output_discard_all ();
+    }
+
+    sneptile_pool_free ();
+
     return rc == RC_OK ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,383 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Output files shared by the VDP writers.
+ *
+ * Large outputs are mostly hex literals, so rather than formatting each
+ * value with fprintf, they are built from a table of digit pairs into a
+ * buffer which is written out in large blocks.
+ *
+ * Each file is written to a temporary file, and compared against the existing
+ * file as it is written. The existing file is only replaced if the contents
+ * have changed, so that its modification time is left alone and anything that
+ * includes it is not rebuilt.
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sneptile.h"
+#include "output.h"
+
+/* Two lower-case hex digits for each byte value */
+static char hex_digits [256] [2];
+
+/* Existing file contents, to compare with the buffer as it is written */
+static char compare_buffer [OUTPUT_BUFFER_SIZE];
+
+/* Output files that have not yet been closed */
+static output_t *open_outputs = NULL;
+
+
+/*
+ * Write out the contents of the buffer.
+ */
+static void output_flush (output_t *output)
+{
+    if (output->used != 0 && fwrite (output->buffer, 1, output->used, output->file) != output->used)
+    {
+        output->error = true;
+    }
+
+    /* Stop comparing at the first difference */
+    if (output->existing != NULL &&
+        (fread (compare_buffer, 1, output->used, output->existing) != output->used ||
+         memcmp (compare_buffer, output->buffer, output->used) != 0))
+    {
+        fclose (output->existing);
+        output->existing = NULL;
+    }
+
+    output->flushed += output->used;
+    output->used = 0;
+}
+
+
+/*
+ * Make room for at least size bytes in the buffer, which must not exceed its size.
+ */
+static inline char *output_reserve (output_t *output, uint32_t size)
+{
+    if (output->used + size > OUTPUT_BUFFER_SIZE)
+    {
+        output_flush (output);
+    }
+
+    return &output->buffer [output->used];
+}
+
+
+/*
+ * Free an output file's memory, and remove its temporary file.
+ */
+static void output_free (output_t *output)
+{
+    for (output_t **link = &open_outputs; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == output)
+        {
+            *link = output->next;
+            break;
+        }
+    }
+
+    if (output->file != NULL)
+    {
+        fclose (output->file);
+    }
+    if (output->existing != NULL)
+    {
+        fclose (output->existing);
+    }
+    if (output->temp_path != NULL)
+    {
+        remove (output->temp_path);
+    }
+
+    free (output->name);
+    free (output->path);
+    free (output->temp_path);
+    free (output);
+}
+
+
+/*
+ * Open an output file, within the output directory if one has been specified.
+ * Returns NULL and reports the error if the file cannot be opened.
+ */
+output_t *output_open (const char *file_name, const char *mode)
+{
+    static mode_t file_mode = 0;
+    char *template = NULL;
+    output_t *output;
+    int temp_fd;
+
+    /* Temporary files are created as private, give them the permissions fopen would have */
+    if (file_mode == 0)
+    {
+        mode_t mask = umask (0);
+        umask (mask);
+        file_mode = 0666 & ~mask;
+    }
+
+    if (hex_digits [0] [0] == '\0')
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            hex_digits [i] [0] = "0123456789abcdef" [i >> 4];
+            hex_digits [i] [1] = "0123456789abcdef" [i & 0x0f];
+        }
+    }
+
+    output = calloc (1, sizeof (output_t));
+    if (output == NULL)
+    {
+        fprintf (stderr, "Error: Failed to allocate output buffer for %s.\n", file_name);
+        return NULL;
+    }
+
+    if ((output_dir != NULL) ? asprintf (&output->path, "%s/%s", output_dir, file_name) < 0
+                             : (output->path = strdup (file_name)) == NULL)
+    {
+        output->path = NULL;
+    }
+    output->name = strdup (file_name);
+
+    if (output->path == NULL || output->name == NULL || asprintf (&template, "%s.XXXXXX", output->path) < 0)
+    {
+        fprintf (stderr, "Error: Failed to allocate path for %s.\n", file_name);
+        output_free (output);
+        return NULL;
+    }
+
+    temp_fd = mkstemp (template);
+    if (temp_fd == -1)
+    {
+        fprintf (stderr, "Unable to open output file %s\n", file_name);
+        free (template);
+        output_free (output);
+        return NULL;
+    }
+    output->temp_path = template;
+
+    fchmod (temp_fd, file_mode);
+    output->file = fdopen (temp_fd, mode);
+    if (output->file == NULL)
+    {
+        fprintf (stderr, "Unable to open output file %s\n", file_name);
+        close (temp_fd);
+        output_free (output);
+        return NULL;
+    }
+
+    /* A missing existing file is simply treated as different */
+    output->existing = fopen (output->path, "rb");
+
+    output->next = open_outputs;
+    open_outputs = output;
+
+    return output;
+}
+
+
+/*
+ * Flush and close an output file.
+ */
+int output_close (output_t *output)
+{
+    bool unchanged = false;
+    int rc = RC_OK;
+
+    output_flush (output);
+
+    /* The existing file is unchanged if it matched all the way, and has nothing more */
+    if (output->existing != NULL)
+    {
+        unchanged = (fgetc (output->existing) == EOF);
+    }
+
+    int close_rc = fclose (output->file);
+    output->file = NULL;
+
+    if (close_rc != 0 || output->error)
+    {
+        fprintf (stderr, "Error: Failed to write output file %s.\n", output->name);
+        rc = RC_ERROR;
+    }
+    else if (!unchanged)
+    {
+        if (rename (output->temp_path, output->path) != 0)
+        {
+            fprintf (stderr, "Error: Failed to replace output file %s.\n", output->name);
+            rc = RC_ERROR;
+        }
+        else
+        {
+            free (output->temp_path);
+            output->temp_path = NULL;
+        }
+    }
+
+    /* Anything left at temp_path is no longer needed */
+    output_free (output);
+
+    return rc;
+}
+
+
+/*
+ * Discard any output files that are still open, leaving the existing files untouched.
+ * Used after an error, so that a failed run doesn't leave partial output behind.
+ */
+void output_discard_all (void)
+{
+    while (open_outputs != NULL)
+    {
+        output_free (open_outputs);
+    }
+}
+
+
+/*
+ * Get the number of bytes written to an output file.
+ */
+uint64_t output_size (const output_t *output)
+{
+    return output->flushed + output->used;
+}
+
+
+/*
+ * Write a block of bytes.
+ */
+void output_bytes (output_t *output, const void *data, size_t size)
+{
+    const char *bytes = data;
+
+    while (size > 0)
+    {
+        uint32_t chunk = OUTPUT_BUFFER_SIZE - output->used;
+        if (chunk == 0)
+        {
+            output_flush (output);
+            continue;
+        }
+        if (chunk > size)
+        {
+            chunk = size;
+        }
+
+        memcpy (&output->buffer [output->used], bytes, chunk);
+        output->used += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+}
+
+
+/*
+ * Write a string.
+ */
+void output_string (output_t *output, const char *string)
+{
+    output_bytes (output, string, strlen (string));
+}
+
+
+/*
+ * Write a formatted string.
+ * Used for names and headers, values within arrays use output_hex.
+ */
+void output_printf (output_t *output, const char *format, ...)
+{
+    va_list args;
+    int length;
+
+    va_start (args, format);
+    length = vsnprintf (&output->buffer [output->used], OUTPUT_BUFFER_SIZE - output->used, format, args);
+    va_end (args);
+
+    if (length < 0)
+    {
+        output->error = true;
+        return;
+    }
+
+    if (output->used + length < OUTPUT_BUFFER_SIZE)
+    {
+        output->used += length;
+        return;
+    }
+
+    /* Didn't fit, try again with the buffer empty */
+    output_flush (output);
+
+    va_start (args, format);
+    if (length < OUTPUT_BUFFER_SIZE)
+    {
+        vsnprintf (output->buffer, OUTPUT_BUFFER_SIZE, format, args);
+        output->used = length;
+    }
+    else
+    {
+        /* Larger than the buffer, format it separately so that it is still
+         * compared against the existing file as it is written */
+        char *text = malloc ((size_t) length + 1);
+        if (text == NULL)
+        {
+            output->error = true;
+        }
+        else
+        {
+            vsnprintf (text, (size_t) length + 1, format, args);
+            output_bytes (output, text, length);
+            free (text);
+        }
+    }
+    va_end (args);
+}
+
+
+/*
+ * Write a value as a lower-case hex literal, with the given number of digits (2, 4, or 8).
+ */
+void output_hex (output_t *output, uint32_t value, uint32_t digits)
+{
+    char *c = output_reserve (output, digits + 2);
+
+    c [0] = '0';
+    c [1] = 'x';
+
+    for (uint32_t i = 0; i < digits / 2; i++)
+    {
+        memcpy (&c [digits - 2 * i], hex_digits [(value >> (8 * i)) & 0xff], 2);
+    }
+
+    output->used += digits + 2;
+}
+
+
+/*
+ * Write a value as little-endian bytes.
+ * The Z80 is little-endian, so name-table entries and GG colours
+ * can be copied to VRAM or CRAM without any conversion.
+ */
+void output_le (output_t *output, uint32_t value, uint32_t size)
+{
+    char *c = output_reserve (output, size);
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+        c [i] = value >> (8 * i);
+    }
+
+    output->used += size;
+}
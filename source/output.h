@@ -0,0 +1,48 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ */
+
+/* Output is collected and written in blocks of this size */
+#define OUTPUT_BUFFER_SIZE 65536
+
+/* Buffered output file, written to a temporary file until it is closed */
+typedef struct output_s {
+    struct output_s *next;
+    FILE *file;
+    FILE *existing;
+    char *name;
+    char *path;
+    char *temp_path;
+    uint64_t flushed;
+    bool error;
+    uint32_t used;
+    char buffer [OUTPUT_BUFFER_SIZE];
+} output_t;
+
+/* Open an output file, within the output directory if one has been specified. */
+output_t *output_open (const char *file_name, const char *mode);
+
+/* Flush and close an output file, replacing the existing file only if the contents have changed. */
+int output_close (output_t *output);
+
+/* Discard any output files that are still open, leaving the existing files untouched. */
+void output_discard_all (void);
+
+/* Get the number of bytes written to an output file. */
+uint64_t output_size (const output_t *output);
+
+/* Write a block of bytes. */
+void output_bytes (output_t *output, const void *data, size_t size);
+
+/* Write a string. */
+void output_string (output_t *output, const char *string);
+
+/* Write a formatted string. */
+void output_printf (output_t *output, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+/* Write a value as a lower-case hex literal, with the given number of digits. */
+void output_hex (output_t *output, uint32_t value, uint32_t digits);
+
+/* Write a value as little-endian bytes. */
+void output_le (output_t *output, uint32_t value, uint32_t size);
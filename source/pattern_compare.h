@@ -0,0 +1,44 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ */
+
+#if defined (__AVX2__) || defined (__SSE2__)
+#include <immintrin.h>
+#endif
+
+_Static_assert (PATTERN_KEY_SIZE == 32, "pattern comparison expects 32-byte keys");
+
+/*
+ * Check if two 32-byte patterns are identical.
+ * The whole pattern is compared without branching, with a single test at the end.
+ */
+static inline bool sneptile_pattern_equal (const uint8_t *pattern_a, const uint8_t *pattern_b)
+{
+#if defined (__AVX2__)
+    __m256i a = _mm256_loadu_si256 ((const __m256i *) pattern_a);
+    __m256i b = _mm256_loadu_si256 ((const __m256i *) pattern_b);
+    __m256i diff = _mm256_xor_si256 (a, b);
+
+    return _mm256_testz_si256 (diff, diff);
+#elif defined (__SSE2__)
+    __m128i eq_lo = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) &pattern_a [0]),
+                                    _mm_loadu_si128 ((const __m128i *) &pattern_b [0]));
+    __m128i eq_hi = _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) &pattern_a [16]),
+                                    _mm_loadu_si128 ((const __m128i *) &pattern_b [16]));
+
+    return _mm_movemask_epi8 (_mm_and_si128 (eq_lo, eq_hi)) == 0xffff;
+#else
+    uint64_t diff = 0;
+
+    for (uint32_t i = 0; i < PATTERN_KEY_SIZE; i += sizeof (uint64_t))
+    {
+        uint64_t a, b;
+        memcpy (&a, &pattern_a [i], sizeof (uint64_t));
+        memcpy (&b, &pattern_b [i], sizeof (uint64_t));
+        diff |= a ^ b;
+    }
+
+    return diff == 0;
+#endif
+}
@@ -0,0 +1,990 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Reading and decoding input sheets.
+ *
+ * Decoding a sheet only depends on the sheet itself, so it can be done on
+ * worker threads ahead of time. Anything that depends on the sheets before
+ * it, such as the mode-4 palettes and pattern indices, is left until the
+ * sheet is committed, which is always done in command-line order.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <spng.h>
+
+#include "sneptile.h"
+#include "cache.h"
+#include "sheet.h"
+#include "sms_vdp.h"
+#include "tms9928a.h"
+
+/* Skip checksum verification for inputs that are known to be intact */
+bool trusted_input = false;
+
+/* Worker threads */
+static pthread_t *workers = NULL;
+static uint32_t worker_count = 0;
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+static sheet_t *worker_sheets = NULL;
+static uint32_t worker_sheet_count = 0;
+static uint32_t next_sheet = 0;
+static uint32_t committed_sheets = 0;
+static uint32_t lookahead = 0;
+static bool workers_stopping = false;
+
+/* Decoder memory. Each thread keeps its own arena, which is re-used from sheet
+ * to sheet rather than returning the decoder's allocations to the system. */
+#define ARENA_ALIGN 16
+typedef struct sheet_arena_s {
+    uint8_t *memory;
+    size_t size;
+    size_t used;
+    size_t last;        /* Offset of the most recent allocation */
+    size_t wanted;      /* Memory needed since the last reset, including allocations that did not fit */
+} sheet_arena_t;
+
+static _Thread_local sheet_arena_t arena = { };
+
+
+/*
+ * Allocate from the arena, falling back to malloc if it is full.
+ * Each allocation is preceded by its size, for realloc.
+ */
+static void *sheet_arena_malloc (size_t size)
+{
+    size_t block_size = ARENA_ALIGN + ((size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1));
+    uint8_t *block;
+
+    if (size > SIZE_MAX - 2 * ARENA_ALIGN)
+    {
+        return NULL;
+    }
+
+    arena.wanted += block_size;
+
+    if (arena.size - arena.used >= block_size)
+    {
+        block = &arena.memory [arena.used];
+        arena.last = arena.used;
+        arena.used += block_size;
+    }
+    else
+    {
+        block = malloc (block_size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    *(size_t *) block = size;
+    return block + ARENA_ALIGN;
+}
+
+
+/*
+ * Check if an allocation was made from the arena.
+ */
+static bool sheet_arena_owns (const uint8_t *block)
+{
+    return arena.memory != NULL && block >= arena.memory && block < arena.memory + arena.size;
+}
+
+
+/*
+ * Free an allocation. Only the most recent allocation in the arena can be
+ * returned to it, the rest is reclaimed when the arena is reset.
+ */
+static void sheet_arena_free (void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    uint8_t *block = (uint8_t *) ptr - ARENA_ALIGN;
+
+    if (!sheet_arena_owns (block))
+    {
+        free (block);
+    }
+    else if (block == &arena.memory [arena.last])
+    {
+        arena.used = arena.last;
+    }
+}
+
+
+/*
+ * Resize an allocation, in place if it is the most recent allocation in the arena.
+ */
+static void *sheet_arena_realloc (void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return sheet_arena_malloc (size);
+    }
+
+    uint8_t *block = (uint8_t *) ptr - ARENA_ALIGN;
+    size_t old_size = *(size_t *) block;
+
+    if (sheet_arena_owns (block) && block == &arena.memory [arena.last] && size <= SIZE_MAX - 2 * ARENA_ALIGN)
+    {
+        size_t block_size = ARENA_ALIGN + ((size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1));
+
+        if (arena.size - arena.last >= block_size)
+        {
+            arena.wanted = arena.wanted - (arena.used - arena.last) + block_size;
+            arena.used = arena.last + block_size;
+            *(size_t *) block = size;
+            return ptr;
+        }
+    }
+
+    void *new_ptr = sheet_arena_malloc (size);
+    if (new_ptr != NULL)
+    {
+        memcpy (new_ptr, ptr, old_size < size ? old_size : size);
+        sheet_arena_free (ptr);
+    }
+    return new_ptr;
+}
+
+
+/*
+ * Allocate cleared memory from the arena.
+ */
+static void *sheet_arena_calloc (size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+
+    void *ptr = sheet_arena_malloc (count * size);
+    if (ptr != NULL)
+    {
+        memset (ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+
+/*
+ * Reset the arena once nothing in it is in use.
+ * If the last sheet did not fit, the arena is grown to hold it.
+ */
+static void sheet_arena_reset (void)
+{
+    if (arena.wanted > arena.size)
+    {
+        free (arena.memory);
+        arena.memory = malloc (arena.wanted);
+        arena.size = (arena.memory != NULL) ? arena.wanted : 0;
+    }
+
+    arena.used = 0;
+    arena.last = 0;
+    arena.wanted = 0;
+}
+
+
+/*
+ * Get the size of the tiles used by the target, in pixels.
+ */
+uint32_t sheet_tile_size (void)
+{
+    return (target == VDP_MODE_TMS_LARGE_SPRITES) ? 16 : 8;
+}
+
+
+/*
+ * Set the cache key, covering the file contents and the options used to process it.
+ */
+static void sheet_set_key (sheet_t *sheet)
+{
+    uint32_t options [] = { target, dedup_global, dedup_flips, dedup_tms, sheet->use_background_palette,
+                            sheet->panel_width, sheet->panel_height, sheet->panel_count, sheet->max_patterns,
+                            sheet->region_x, sheet->region_y, sheet->region_width, sheet->region_height };
+
+    sheet->key = cache_hash (sheet->content_hash, options, sizeof (options));
+}
+
+
+/*
+ * Take a sheet's decoded tiles from the cache, if the file is unchanged since they were stored.
+ */
+static int sheet_load_tiles (sheet_t *sheet)
+{
+    cache_tiles_t entry = {
+        .mtime_sec = sheet->mtime_sec,
+        .mtime_nsec = sheet->mtime_nsec,
+        .file_size = sheet->png_size,
+        .region = { sheet->region_x, sheet->region_y, sheet->region_width, sheet->region_height }
+    };
+
+    if (cache_tiles_load (sheet->path, &entry) != RC_OK)
+    {
+        return RC_ERROR;
+    }
+
+    sheet->content_hash = entry.content_hash;
+    sheet->width = entry.width;
+    sheet->height = entry.height;
+    sheet->colour_count = entry.colour_count;
+    memcpy (sheet->colours, entry.colours, sizeof (sheet->colours));
+    sheet->tiles = entry.tiles;
+    sheet->tiles_mapping = entry.mapping;
+    sheet->tiles_mapping_size = entry.mapping_size;
+
+    return RC_OK;
+}
+
+
+/*
+ * Store a sheet's decoded tiles in the cache.
+ */
+static void sheet_store_tiles (sheet_t *sheet)
+{
+    cache_tiles_t entry = {
+        .mtime_sec = sheet->mtime_sec,
+        .mtime_nsec = sheet->mtime_nsec,
+        .file_size = sheet->png_size,
+        .region = { sheet->region_x, sheet->region_y, sheet->region_width, sheet->region_height },
+        .content_hash = sheet->content_hash,
+        .width = sheet->width,
+        .height = sheet->height,
+        .colour_count = sheet->colour_count,
+        .tiles = sheet->tiles
+    };
+    memcpy (entry.colours, sheet->colours, sizeof (entry.colours));
+
+    cache_tiles_store (sheet->path, &entry);
+}
+
+
+/*
+ * Ask the kernel to read a sheet's file in the background, ahead of it being needed.
+ * Unless asked to verify them, cached files are not read, so are not prefetched.
+ */
+void sheet_prefetch (const sheet_t *sheet)
+{
+    if (cache_dir != NULL && !cache_verify)
+    {
+        return;
+    }
+
+    int png_fd = open (sheet->path, O_RDONLY);
+    if (png_fd != -1)
+    {
+        posix_fadvise (png_fd, 0, 0, POSIX_FADV_WILLNEED);
+        close (png_fd);
+    }
+}
+
+
+/*
+ * Map a sheet's file and hash its contents.
+ * If the cache has the decoded tiles of an unchanged file, they are mapped instead.
+ */
+int sheet_read (sheet_t *sheet)
+{
+    /* Try to open the file */
+    int png_fd = open (sheet->path, O_RDONLY);
+    if (png_fd == -1)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Unable to open %s.\n", sheet->path);
+        return RC_ERROR;
+    }
+
+    /* Get the file size */
+    struct stat png_stat;
+    if (fstat (png_fd, &png_stat) != 0 || !S_ISREG (png_stat.st_mode) || png_stat.st_size == 0)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: %s is not a valid .png file or raw sheet.\n", sheet->name);
+        close (png_fd);
+        return RC_ERROR;
+    }
+    sheet->png_size = png_stat.st_size;
+    sheet->mtime_sec = png_stat.st_mtim.tv_sec;
+    sheet->mtime_nsec = png_stat.st_mtim.tv_nsec;
+
+    /* Unless asked to verify the contents, an unchanged file is not read at all */
+    if (cache_dir != NULL && sheet_load_tiles (sheet) == RC_OK && !cache_verify)
+    {
+        close (png_fd);
+        sheet_set_key (sheet);
+        sheet->read = true;
+        return RC_OK;
+    }
+
+    /* Map the file, it is read once from start to end */
+    sheet->png_buffer = mmap (NULL, sheet->png_size, PROT_READ, MAP_PRIVATE, png_fd, 0);
+    close (png_fd);
+    if (sheet->png_buffer == MAP_FAILED)
+    {
+        sheet->png_buffer = NULL;
+        sheet_free_tiles (sheet);
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to map %s.\n", sheet->name);
+        return RC_ERROR;
+    }
+    posix_madvise (sheet->png_buffer, sheet->png_size, POSIX_MADV_SEQUENTIAL);
+
+    if (cache_dir != NULL)
+    {
+        uint64_t content_hash = cache_hash (CACHE_HASH_INIT, sheet->png_buffer, sheet->png_size);
+
+        /* Cached tiles are only used if they were decoded from the same contents */
+        if (sheet->tiles != NULL && sheet->content_hash != content_hash)
+        {
+            sheet_free_tiles (sheet);
+        }
+
+        sheet->content_hash = content_hash;
+        sheet_set_key (sheet);
+    }
+
+    sheet->read = true;
+    return RC_OK;
+}
+
+
+/*
+ * Start decoding a raw sheet.
+ * The pixels are palette indices, and are used in place from the mapped file.
+ */
+static int sheet_open_raw (sheet_t *sheet)
+{
+    const uint8_t *header = sheet->png_buffer;
+
+    if (sheet->png_size < SHEET_RAW_HEADER_SIZE)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: %s is not a valid raw sheet, its header is incomplete.\n",
+                  sheet->name);
+        return RC_ERROR;
+    }
+
+    uint32_t palette_size = header [11] + 1;
+
+    sheet->raw = true;
+    sheet->indexed = true;
+    sheet->image_width = header [4] | (header [5] << 8);
+    sheet->image_height = header [6] | (header [7] << 8);
+
+    if (header [8] > SHEET_RAW_PALETTE_TMS ||
+        sheet->png_size != SHEET_RAW_HEADER_SIZE + palette_size + (size_t) sheet->image_width * sheet->image_height)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: %s is not a valid raw sheet.\n", sheet->name);
+        return RC_ERROR;
+    }
+
+    /* Indices beyond the palette are transparent */
+    const uint8_t *palette = &sheet->png_buffer [SHEET_RAW_HEADER_SIZE];
+    memset (sheet->plte, 0, sizeof (sheet->plte));
+    for (uint32_t i = 0; i < palette_size; i++)
+    {
+        if (header [8] == SHEET_RAW_PALETTE_TMS)
+        {
+            if (palette [i] > 15)
+            {
+                snprintf (sheet->error, sizeof (sheet->error), "Error: %s has an invalid tms9928a colour.\n", sheet->name);
+                return RC_ERROR;
+            }
+            sheet->plte [i] = tms9928a_colour_to_pixel (palette [i]);
+        }
+        else
+        {
+            /* Master System colours only have six bits */
+            if (palette [i] > 0x3f)
+            {
+                snprintf (sheet->error, sizeof (sheet->error), "Error: %s is not a valid raw sheet.\n", sheet->name);
+                return RC_ERROR;
+            }
+            sheet->plte [i] = mode4_colour_to_pixel (palette [i]);
+        }
+    }
+
+    if ((header [10] & SHEET_RAW_HAS_TRANSPARENT) && header [9] < palette_size)
+    {
+        sheet->plte [header [9]].a = 0;
+    }
+
+    memset (sheet->plte_lut, 0xff, sizeof (sheet->plte_lut));
+    memset (sheet->colour_lut, 0xff, sizeof (sheet->colour_lut));
+    sheet->raw_pixels = &palette [palette_size];
+
+    return RC_OK;
+}
+
+
+/*
+ * Start decoding a .png sheet.
+ * Palette images are decoded as palette indices, and each palette entry
+ * is only converted to a sheet colour the first time it is used.
+ */
+static int sheet_open_png (sheet_t *sheet)
+{
+    struct spng_ihdr header = { };
+    size_t image_size = 0;
+
+    struct spng_alloc alloc = {
+        .malloc_fn = sheet_arena_malloc,
+        .realloc_fn = sheet_arena_realloc,
+        .calloc_fn = sheet_arena_calloc,
+        .free_fn = sheet_arena_free
+    };
+
+    sheet->spng_context = spng_ctx_new2 (&alloc, trusted_input ? SPNG_CTX_IGNORE_ADLER32 : 0);
+    if (sheet->spng_context == NULL)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to create decoder for %s.\n", sheet->name);
+        return RC_ERROR;
+    }
+
+    /* Trusted inputs are decoded without calculating the chunk CRCs */
+    if (trusted_input && spng_set_crc_action (sheet->spng_context, SPNG_CRC_USE, SPNG_CRC_USE) != 0)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to configure decoder for %s.\n", sheet->name);
+        return RC_ERROR;
+    }
+
+    if (spng_set_png_buffer (sheet->spng_context, sheet->png_buffer, sheet->png_size) != 0)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to set file buffer for %s.\n", sheet->name);
+        return RC_ERROR;
+    }
+
+    if (spng_get_ihdr (sheet->spng_context, &header) != 0)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to decode image %s.\n", sheet->name);
+        return RC_ERROR;
+    }
+    sheet->image_width = header.width;
+    sheet->image_height = header.height;
+
+    sheet->indexed = (header.color_type == SPNG_COLOR_TYPE_INDEXED);
+    sheet->bit_depth = header.bit_depth;
+    sheet->format = sheet->indexed ? SPNG_FMT_PNG : SPNG_FMT_RGBA8;
+
+    /* Rows of an interlaced image are not complete until the final pass,
+     * so interlaced images are decoded in full. */
+    sheet->progressive = (header.interlace_method == SPNG_INTERLACE_NONE);
+
+    if (sheet->indexed)
+    {
+        struct spng_plte plte = { };
+        struct spng_trns trns = { };
+
+        if (spng_get_plte (sheet->spng_context, &plte) != 0)
+        {
+            snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to decode image %s.\n", sheet->name);
+            return RC_ERROR;
+        }
+
+        /* Entries missing from the tRNS chunk are opaque */
+        if (spng_get_trns (sheet->spng_context, &trns) != 0)
+        {
+            trns.n_type3_entries = 0;
+        }
+
+        for (uint32_t i = 0; i < plte.n_entries; i++)
+        {
+            sheet->plte [i].r = plte.entries [i].red;
+            sheet->plte [i].g = plte.entries [i].green;
+            sheet->plte [i].b = plte.entries [i].blue;
+            sheet->plte [i].a = (i < trns.n_type3_entries) ? trns.type3_alpha [i] : 0xff;
+        }
+        memset (sheet->plte_lut, 0xff, sizeof (sheet->plte_lut));
+    }
+    memset (sheet->colour_lut, 0xff, sizeof (sheet->colour_lut));
+
+    if (spng_decoded_image_size (sheet->spng_context, sheet->format, &image_size) != 0)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to determine decompression size for %s.\n", sheet->name);
+        return RC_ERROR;
+    }
+    sheet->row_size = image_size / header.height;
+
+    /* libspng packs the pixels of interlaced images below 8 bits per pixel into
+     * the buffer by or-ing them in place, so the buffer must start out cleared. */
+    sheet->buffer = sheet_arena_calloc (1, sheet->progressive ? sheet->row_size : image_size);
+    if (sheet->buffer == NULL)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to allocate decompression memory for %s.\n", sheet->name);
+        return RC_ERROR;
+    }
+
+    if (spng_decode_image (sheet->spng_context, sheet->progressive ? NULL : sheet->buffer, sheet->progressive ? 0 : image_size,
+                           sheet->format, (sheet->indexed ? 0 : SPNG_DECODE_TRNS) |
+                                          (sheet->progressive ? SPNG_DECODE_PROGRESSIVE : 0)) != 0)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to decode image %s.\n", sheet->name);
+        return RC_ERROR;
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Start decoding a sheet, and limit it to its region.
+ */
+int sheet_open (sheet_t *sheet)
+{
+    uint32_t tile_size = sheet_tile_size ();
+    int rc;
+
+    if (sheet->png_size >= 4 && memcmp (sheet->png_buffer, SHEET_RAW_MAGIC, 4) == 0)
+    {
+        rc = sheet_open_raw (sheet);
+    }
+    else
+    {
+        rc = sheet_open_png (sheet);
+    }
+
+    if (rc != RC_OK)
+    {
+        return rc;
+    }
+
+    if (sheet->region_width == 0)
+    {
+        sheet->width = sheet->image_width;
+        sheet->height = sheet->image_height;
+        return RC_OK;
+    }
+
+    if (((uint64_t) sheet->region_x + sheet->region_width) * tile_size > sheet->image_width ||
+        ((uint64_t) sheet->region_y + sheet->region_height) * tile_size > sheet->image_height)
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Region %u,%u,%u,%u is outside of %s (%ux%u tiles).\n",
+                  sheet->region_x, sheet->region_y, sheet->region_width, sheet->region_height, sheet->name,
+                  sheet->image_width / tile_size, sheet->image_height / tile_size);
+        return RC_ERROR;
+    }
+    sheet->width = sheet->region_width * tile_size;
+    sheet->height = sheet->region_height * tile_size;
+
+    return RC_OK;
+}
+
+
+/*
+ * Decode the next row of the image.
+ * Indexed rows are unpacked to one byte per pixel, RGBA rows are four bytes per pixel.
+ */
+static int sheet_read_row (sheet_t *sheet, uint8_t *row)
+{
+    uint8_t *decoded = &sheet->buffer [sheet->next_row * sheet->row_size];
+
+    if (sheet->progressive)
+    {
+        decoded = sheet->buffer;
+
+        int ret = spng_decode_row (sheet->spng_context, decoded, sheet->row_size);
+        if (ret != 0 && !(ret == SPNG_EOI && sheet->next_row + 1 == sheet->image_height))
+        {
+            return RC_ERROR;
+        }
+    }
+    sheet->next_row++;
+
+    if (sheet->indexed && sheet->bit_depth < 8)
+    {
+        uint8_t mask = (1 << sheet->bit_depth) - 1;
+
+        for (uint32_t x = 0; x < sheet->image_width; x++)
+        {
+            uint32_t bit = x * sheet->bit_depth;
+            row [x] = (decoded [bit / 8] >> (8 - sheet->bit_depth - bit % 8)) & mask;
+        }
+    }
+    else
+    {
+        memcpy (row, decoded, sheet->image_width * (sheet->indexed ? 1 : sizeof (pixel_t)));
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Convert a pixel to its sheet colour.
+ * For mode-4, this is an index into the sheet's own colour list.
+ * For the TMS99xx modes, this is the tms9928a colour.
+ */
+static uint8_t sheet_pixel_to_colour (sheet_t *sheet, pixel_t p)
+{
+    switch (target)
+    {
+        case VDP_MODE_4:
+        case VDP_MODE_4_SPRITES:
+            if (p.a == 0)
+            {
+                return 0;
+            }
+            else
+            {
+                uint8_t colour = mode4_pixel_to_colour (p);
+                if (sheet->colour_lut [colour] == -1)
+                {
+                    sheet->colours [sheet->colour_count] = colour;
+                    sheet->colour_lut [colour] = ++sheet->colour_count;
+                }
+                return sheet->colour_lut [colour];
+            }
+        default:
+            return tms9928a_rgb_to_colour_index (p);
+    }
+}
+
+
+/*
+ * Convert a tile from a band of decoded rows to its sheet colours.
+ * The colours are written with a stride of the tile width.
+ */
+static void sheet_tile_to_colours (sheet_t *sheet, const uint8_t *band, uint32_t col, uint8_t *colours)
+{
+    uint32_t tile_size = sheet_tile_size ();
+
+    for (uint32_t y = 0; y < tile_size; y++)
+    {
+        for (uint32_t x = 0; x < tile_size; x++)
+        {
+            uint32_t offset = y * sheet->image_width + col + x;
+
+            if (sheet->indexed)
+            {
+                uint8_t entry = band [offset];
+                if (sheet->plte_lut [entry] == -1)
+                {
+                    sheet->plte_lut [entry] = sheet_pixel_to_colour (sheet, sheet->plte [entry]);
+                }
+                colours [y * tile_size + x] = sheet->plte_lut [entry];
+            }
+            else
+            {
+                colours [y * tile_size + x] = sheet_pixel_to_colour (sheet, ((const pixel_t *) band) [offset]);
+            }
+        }
+    }
+}
+
+
+/*
+ * Decode a sheet, one row of tiles at a time.
+ * Each tile's colours are passed to the callback, or kept in sheet->tiles if the callback is NULL.
+ * Only a band of tile_size rows needs to be held in memory.
+ * Decoding stops after the last row of the sheet's region.
+ */
+int sheet_decode (sheet_t *sheet, sheet_tile_callback_t callback, void *context)
+{
+    uint32_t tile_size = sheet_tile_size ();
+    uint32_t tile_pixels = tile_size * tile_size;
+    uint32_t tile_count = 0;
+    int rc = RC_OK;
+
+    /* Sanity check */
+    if ((sheet->width % tile_size != 0) || (sheet->height % tile_size != 0))
+    {
+        snprintf (sheet->error, sizeof (sheet->error), "Error: Invalid resolution %ux%u\n", sheet->width, sheet->height);
+        return RC_ERROR;
+    }
+
+    /* Decoded rows are collected into a band that holds a single row of tiles.
+     * Raw sheets are already one byte per pixel, so are used in place. */
+    size_t band_row_size = sheet->image_width * (sheet->indexed ? 1 : sizeof (pixel_t));
+    uint32_t first_row = sheet->region_y * tile_size;
+    uint32_t first_col = sheet->region_x * tile_size;
+    uint8_t *band = NULL;
+    if (!sheet->raw)
+    {
+        band = sheet_arena_malloc (band_row_size * tile_size);
+        if (band == NULL)
+        {
+            snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to allocate memory for %s.\n", sheet->name);
+            return RC_ERROR;
+        }
+    }
+
+    if (callback == NULL)
+    {
+        sheet->tiles = malloc ((size_t) sheet->width * sheet->height);
+        if (sheet->tiles == NULL)
+        {
+            snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to allocate memory for %s.\n", sheet->name);
+            rc = RC_ERROR;
+        }
+    }
+
+    /* Rows above the region still need to be decoded, but are not used */
+    for (uint32_t y = 0; y < first_row && rc == RC_OK && !sheet->raw; y++)
+    {
+        if (sheet_read_row (sheet, band) != RC_OK)
+        {
+            snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to decode image %s.\n", sheet->name);
+            rc = RC_ERROR;
+        }
+    }
+
+    for (uint32_t row = 0; row < sheet->height && rc == RC_OK; row += tile_size)
+    {
+        if (sheet->raw)
+        {
+            band = (uint8_t *) &sheet->raw_pixels [(size_t) (first_row + row) * band_row_size];
+        }
+
+        for (uint32_t y = 0; y < tile_size && !sheet->raw; y++)
+        {
+            if (sheet_read_row (sheet, &band [y * band_row_size]) != RC_OK)
+            {
+                snprintf (sheet->error, sizeof (sheet->error), "Error: Failed to decode image %s.\n", sheet->name);
+                rc = RC_ERROR;
+                break;
+            }
+        }
+
+        for (uint32_t col = first_col; col < first_col + sheet->width && rc == RC_OK; col += tile_size)
+        {
+            if (callback == NULL)
+            {
+                sheet_tile_to_colours (sheet, band, col, &sheet->tiles [(size_t) tile_count * tile_pixels]);
+            }
+            else
+            {
+                uint8_t colours [16 * 16];
+                sheet_tile_to_colours (sheet, band, col, colours);
+                rc = callback (context, colours);
+            }
+            tile_count++;
+        }
+    }
+
+    if (!sheet->raw)
+    {
+        sheet_arena_free (band);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Decode a sheet in full, keeping the colours of its tiles.
+ * With a cache, the tiles are also stored for later runs.
+ */
+int sheet_decode_tiles (sheet_t *sheet)
+{
+    int rc = sheet_open (sheet);
+
+    if (rc == RC_OK)
+    {
+        rc = sheet_decode (sheet, NULL, NULL);
+    }
+
+    /* Raw sheets are quick to convert again, so are not worth caching */
+    if (rc == RC_OK && cache_dir != NULL && !sheet->raw)
+    {
+        sheet_store_tiles (sheet);
+    }
+
+    if (rc != RC_OK)
+    {
+        sheet_free_tiles (sheet);
+    }
+
+    sheet_close (sheet);
+
+    return rc;
+}
+
+
+/*
+ * Free the colours of a sheet's tiles, or unmap them if they came from the cache.
+ */
+void sheet_free_tiles (sheet_t *sheet)
+{
+    if (sheet->tiles_mapping != NULL)
+    {
+        munmap (sheet->tiles_mapping, sheet->tiles_mapping_size);
+        sheet->tiles_mapping = NULL;
+    }
+    else
+    {
+        free (sheet->tiles);
+    }
+    sheet->tiles = NULL;
+}
+
+
+/*
+ * Free the decoder and unmap the file.
+ */
+void sheet_close (sheet_t *sheet)
+{
+    if (sheet->spng_context != NULL)
+    {
+        spng_ctx_free (sheet->spng_context);
+        sheet->spng_context = NULL;
+    }
+
+    sheet_arena_free (sheet->buffer);
+    sheet->buffer = NULL;
+    sheet_arena_reset ();
+
+    if (sheet->png_buffer != NULL)
+    {
+        munmap (sheet->png_buffer, sheet->png_size);
+        sheet->png_buffer = NULL;
+    }
+}
+
+
+/*
+ * Free the calling thread's decoder memory.
+ */
+void sheet_release (void)
+{
+    free (arena.memory);
+    arena = (sheet_arena_t) { };
+}
+
+
+/*
+ * Worker thread, reads and decodes sheets in order.
+ */
+static void *sheet_worker (void *arg)
+{
+    (void) arg;
+
+    while (true)
+    {
+        /* Take the next sheet, staying no more than lookahead sheets ahead of the commits */
+        pthread_mutex_lock (&worker_mutex);
+        while (!workers_stopping && next_sheet < worker_sheet_count && next_sheet >= committed_sheets + lookahead)
+        {
+            pthread_cond_wait (&worker_cond, &worker_mutex);
+        }
+        if (workers_stopping || next_sheet >= worker_sheet_count)
+        {
+            pthread_mutex_unlock (&worker_mutex);
+            break;
+        }
+        sheet_t *sheet = &worker_sheets [next_sheet++];
+        pthread_mutex_unlock (&worker_mutex);
+
+        /* If the cache may already have the result, decoding is left until the sheet is committed */
+        if (sheet_read (sheet) == RC_OK && sheet->tiles == NULL && !(cache_dir != NULL && cache_probe (sheet->key)))
+        {
+            sheet_decode_tiles (sheet);
+        }
+
+        pthread_mutex_lock (&worker_mutex);
+        sheet->done = true;
+        pthread_cond_broadcast (&worker_cond);
+        pthread_mutex_unlock (&worker_mutex);
+    }
+
+    sheet_release ();
+
+    return NULL;
+}
+
+
+/*
+ * Start worker threads to read and decode sheets ahead of them being committed.
+ */
+int sheet_workers_start (sheet_t *sheets, uint32_t count, uint32_t jobs)
+{
+    worker_sheets = sheets;
+    worker_sheet_count = count;
+    next_sheet = 0;
+    committed_sheets = 0;
+    workers_stopping = false;
+
+    /* Each worker may have up to two decoded sheets waiting to be committed */
+    lookahead = jobs * 2;
+
+    workers = calloc (jobs, sizeof (pthread_t));
+    if (workers == NULL)
+    {
+        fprintf (stderr, "Error: Failed to allocate worker threads.\n");
+        return RC_ERROR;
+    }
+
+    for (worker_count = 0; worker_count < jobs; worker_count++)
+    {
+        if (pthread_create (&workers [worker_count], NULL, sheet_worker, NULL) != 0)
+        {
+            fprintf (stderr, "Error: Failed to start worker thread.\n");
+            sheet_workers_stop ();
+            return RC_ERROR;
+        }
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Wait for a sheet to be decoded.
+ */
+sheet_t *sheet_wait (uint32_t index)
+{
+    pthread_mutex_lock (&worker_mutex);
+    while (!worker_sheets [index].done)
+    {
+        pthread_cond_wait (&worker_cond, &worker_mutex);
+    }
+    pthread_mutex_unlock (&worker_mutex);
+
+    return &worker_sheets [index];
+}
+
+
+/*
+ * Mark a sheet as committed, allowing the workers to move further ahead.
+ */
+void sheet_committed (uint32_t index)
+{
+    pthread_mutex_lock (&worker_mutex);
+    committed_sheets = index + 1;
+    pthread_cond_broadcast (&worker_cond);
+    pthread_mutex_unlock (&worker_mutex);
+}
+
+
+/*
+ * Stop the worker threads.
+ * Sheets that have not been started are left undecoded.
+ */
+void sheet_workers_stop (void)
+{
+    pthread_mutex_lock (&worker_mutex);
+    workers_stopping = true;
+    pthread_cond_broadcast (&worker_cond);
+    pthread_mutex_unlock (&worker_mutex);
+
+    for (uint32_t i = 0; i < worker_count; i++)
+    {
+        pthread_join (workers [i], NULL);
+    }
+
+    free (workers);
+    workers = NULL;
+    worker_count = 0;
+}
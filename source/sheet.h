@@ -0,0 +1,124 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ */
+
+extern bool trusted_input;
+
+/* Raw sheets are pre-indexed pixels, with a 12-byte header:
+ *   0: "SNRW"
+ *   4: Width in pixels, 16-bit little-endian
+ *   6: Height in pixels, 16-bit little-endian
+ *   8: Palette type, SHEET_RAW_PALETTE_SMS or SHEET_RAW_PALETTE_TMS
+ *   9: Transparent index, if flagged
+ *  10: Flags
+ *  11: Number of palette entries, minus one
+ * The header is followed by the palette entries, one byte each, then one palette index per pixel. */
+#define SHEET_RAW_MAGIC "SNRW"
+#define SHEET_RAW_HEADER_SIZE 12
+#define SHEET_RAW_PALETTE_SMS 0     /* 6-bit Master System colours */
+#define SHEET_RAW_PALETTE_TMS 1     /* tms9928a colours, with colour 0 transparent */
+#define SHEET_RAW_HAS_TRANSPARENT 0x01
+
+/* Called with the colours of each tile, in order */
+typedef int (*sheet_tile_callback_t) (void *context, const uint8_t *colours);
+
+/* An input sheet, with the per-sheet options that apply to it */
+typedef struct sheet_s {
+    char *path;
+    char *name;
+    bool use_background_palette;
+    uint32_t panel_width;
+    uint32_t panel_height;
+    uint32_t panel_count;
+    uint32_t max_patterns;
+
+    /* Region of the image to use, in tiles, or all of it if region_width is zero */
+    uint32_t region_x;
+    uint32_t region_y;
+    uint32_t region_width;
+    uint32_t region_height;
+
+    /* Input file */
+    uint8_t *png_buffer;
+    size_t png_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t content_hash;
+    uint64_t key;                   /* Hash of the contents and options, for the cache */
+    bool read;
+
+    /* Decoder */
+    bool raw;                       /* Raw sheet, used in place rather than decoded */
+    const uint8_t *raw_pixels;
+    spng_ctx *spng_context;
+    enum spng_format format;
+    bool indexed;                   /* Palette image, decoded as palette indices */
+    bool progressive;               /* Decoded a row at a time, otherwise in full */
+    uint8_t bit_depth;
+    size_t row_size;                /* Size of a decoded row, before unpacking */
+    uint8_t *buffer;                /* The last decoded row, or the full image */
+    uint32_t next_row;
+    pixel_t plte [256];             /* Colour of each palette entry */
+    int16_t plte_lut [256];         /* Sheet colour of each palette entry, -1 until first used */
+
+    /* Decoded image, the width and height are those of the region */
+    uint32_t image_width;
+    uint32_t image_height;
+    uint32_t width;
+    uint32_t height;
+
+    /* For mode-4, tile colours are indices into the sheet's own list of Master
+     * System colours, in the order they are first seen, with 0 for transparent.
+     * These are mapped to the shared palettes when the sheet is committed. */
+    uint8_t colours [64];
+    uint32_t colour_count;
+    int8_t colour_lut [64];
+
+    /* Colours of each tile, when the sheet is decoded ahead by a worker or taken from the cache */
+    uint8_t *tiles;
+    void *tiles_mapping;
+    size_t tiles_mapping_size;
+
+    bool done;
+    char error [256];
+} sheet_t;
+
+/* Get the size of the tiles used by the target, in pixels. */
+uint32_t sheet_tile_size (void);
+
+/* Ask the kernel to read a sheet's file in the background. */
+void sheet_prefetch (const sheet_t *sheet);
+
+/* Map a sheet's file and hash its contents, or map its decoded tiles from the cache. */
+int sheet_read (sheet_t *sheet);
+
+/* Start decoding a sheet. */
+int sheet_open (sheet_t *sheet);
+
+/* Decode a sheet, passing each tile's colours to the callback, or keeping them if the callback is NULL. */
+int sheet_decode (sheet_t *sheet, sheet_tile_callback_t callback, void *context);
+
+/* Decode a sheet in full, keeping the colours of its tiles. */
+int sheet_decode_tiles (sheet_t *sheet);
+
+/* Free the colours of a sheet's tiles. */
+void sheet_free_tiles (sheet_t *sheet);
+
+/* Free the decoder and unmap the file. The thread's decoder memory is kept for the next sheet. */
+void sheet_close (sheet_t *sheet);
+
+/* Free the calling thread's decoder memory. */
+void sheet_release (void);
+
+/* Start worker threads to read and decode sheets ahead of them being committed. */
+int sheet_workers_start (sheet_t *sheets, uint32_t count, uint32_t jobs);
+
+/* Wait for a sheet to be decoded. */
+sheet_t *sheet_wait (uint32_t index);
+
+/* Mark a sheet as committed, allowing the workers to move further ahead. */
+void sheet_committed (uint32_t index);
+
+/* Stop the worker threads. */
+void sheet_workers_stop (void);
@@ -12,6 +12,8 @@
 #include <string.h>
 
 #include "sneptile.h"
+#include "compress.h"
+#include "output.h"
 #include "sms_vdp.h"
 
 /* State */
@@ -24,9 +26,30 @@ static uint8_t sprite_palette [16] = { };
 static uint32_t sprite_palette_size = 0;
 
 /* Mode-4 Output Files */
-static FILE *pattern_file = NULL;
-static FILE *pattern_index_file = NULL;
-static FILE *palette_file = NULL;
+static output_t *pattern_file = NULL;
+static output_t *pattern_index_file = NULL;
+static output_t *palette_file = NULL;
+
+/* Current sheet's patterns. The array or binary file is only started once
+ * the sheet generates a pattern, as a sheet may share all of its patterns
+ * with earlier sheets when using --dedup-global. */
+static char *sheet_name = NULL;
+static uint32_t sheet_first_pattern = 0;
+static bool sheet_patterns_started = false;
+
+/* Binary output of the current sheet's patterns, for --format bin.
+ * A failure to open the file is reported when the sheet's patterns are finished. */
+static output_t *pattern_bin_file = NULL;
+static bool pattern_bin_error = false;
+
+/* Copy of the current sheet's patterns, for --compress */
+static uint8_t *sheet_patterns = NULL;
+static uint32_t sheet_patterns_capacity = 0;
+static bool sheet_patterns_error = false;
+
+/* Report of the current sheet's compressed indices. The indices are written before
+ * the sheet's patterns are finished, so this is held to print after their report. */
+static char indices_report [128] = "";
 
 
 /*
@@ -34,76 +57,269 @@ static FILE *palette_file = NULL;
  */
 int mode4_open_files (void)
 {
-    char *patterns_path = "patterns.h";
-    char *pattern_index_path = "pattern_index.h";
-    char *palette_path = "palette.h";
-
-    /* If the user has specified an output
-     * directory, create and change into it */
-    if (output_dir != NULL)
-    {
-        asprintf (&patterns_path, "%s/%s", output_dir, patterns_path);
-        asprintf (&pattern_index_path, "%s/%s", output_dir, pattern_index_path);
-        asprintf (&palette_path, "%s/%s", output_dir, palette_path);
-    }
-
     /* Pattern file */
-    pattern_file = fopen (patterns_path, "w");
+    pattern_file = output_open ("patterns.h", "w");
     if (pattern_file == NULL)
     {
-        fprintf (stderr, "Unable to open output file patterns.h\n");
         return RC_ERROR;
     }
-    fprintf (pattern_file, "/*\n");
-    fprintf (pattern_file, " * VDP Pattern data\n");
-    fprintf (pattern_file, " */\n");
+    output_string (pattern_file, "/*\n");
+    output_string (pattern_file, " * VDP Pattern data\n");
+    output_string (pattern_file, " */\n");
 
     /* Pattern index file */
-    pattern_index_file = fopen (pattern_index_path, "w");
+    pattern_index_file = output_open ("pattern_index.h", "w");
     if (pattern_index_file == NULL)
     {
-        fprintf (stderr, "Unable to open output file pattern_index.h\n");
         return RC_ERROR;
     }
-    fprintf (pattern_index_file, "/*\n");
-    fprintf (pattern_index_file, " * VDP Pattern index data\n");
-    fprintf (pattern_index_file, " */\n");
+    output_string (pattern_index_file, "/*\n");
+    output_string (pattern_index_file, " * VDP Pattern index data\n");
+    output_string (pattern_index_file, " */\n");
 
     /* Palette file */
-    palette_file = fopen (palette_path, "w");
+    palette_file = output_open ("palette.h", "w");
     if (palette_file == NULL)
     {
-        fprintf (stderr, "Unable to open output file palette.h\n");
         return RC_ERROR;
     }
-    fprintf (palette_file, "/*\n");
-    fprintf (palette_file, " * VDP Palette data\n");
-    fprintf (palette_file, " */\n");
+    output_string (palette_file, "/*\n");
+    output_string (palette_file, " * VDP Palette data\n");
+    output_string (palette_file, " */\n");
+
+    return RC_OK;
+}
+
+
+/*
+ * Open a binary output file, <name>_<suffix>.bin
+ */
+static output_t *mode4_open_bin_file (const char *name, const char *suffix)
+{
+    char *file_name = NULL;
+    output_t *file;
+
+    if (asprintf (&file_name, "%s_%s.bin", name, suffix) < 0)
+    {
+        fprintf (stderr, "Error: Failed to allocate file name for %s.\n", name);
+        return NULL;
+    }
+
+    file = output_open (file_name, "wb");
+    free (file_name);
+
+    return file;
+}
+
+
+/*
+ * Write compressed data as <name>_<array>, with the header going to
+ * the given file. For binary output, the data goes to its own file.
+ */
+static int mode4_write_compressed (output_t *header, const char *name, const char *array,
+                                   const uint8_t *data, size_t size)
+{
+    if (output_format == OUTPUT_FORMAT_BIN)
+    {
+        output_t *file = mode4_open_bin_file (name, array);
+        if (file == NULL)
+        {
+            return RC_ERROR;
+        }
+
+        output_bytes (file, data, size);
+
+        output_printf (header, "\n/* %s_%s.bin */\n", name, array);
+        output_printf (header, "#define %s_%s_size %zu\n", name, array, size);
+
+        return output_close (file);
+    }
+
+    /* Sixteen bytes per line */
+    output_printf (header, "\nconst uint8_t %s_%s [%zu] = {\n", name, array, size);
+    for (size_t i = 0; i < size; i++)
+    {
+        output_string (header, (i % 16 == 0) ? "    " : " ");
+        output_hex (header, data [i], 2);
+        output_string (header, (i % 16 == 15 || i + 1 == size) ? ",\n" : ",");
+    }
+    output_string (header, "};\n");
+
+    return RC_OK;
+}
+
+
+/*
+ * Compress the current sheet's patterns with each selected codec,
+ * and report how well each did.
+ */
+static int mode4_compress_patterns (void)
+{
+    uint32_t pattern_count = pattern_index - sheet_first_pattern;
+    size_t raw_size = pattern_count * 32;
+
+    if (sheet_patterns_error)
+    {
+        fprintf (stderr, "Error: Failed to allocate patterns to compress for %s.\n", sheet_name);
+        return RC_ERROR;
+    }
 
-    if (output_dir != NULL)
+    if (pattern_count == 0)
     {
-        free (patterns_path);
-        free (pattern_index_path);
-        free (palette_path);
+        printf ("%s: No new patterns to compress.\n", sheet_name);
+        return RC_OK;
     }
 
+    printf ("%s: %u patterns, %zu bytes", sheet_name, pattern_count, raw_size);
+
+    for (uint32_t codec = COMPRESS_PLANES; codec <= COMPRESS_ZX7; codec <<= 1)
+    {
+        const char *codec_name = (codec == COMPRESS_PLANES) ? "planes" : "zx7";
+        char array [32];
+        uint8_t *compressed;
+        size_t size = 0;
+
+        if (!(compress_codecs & codec))
+        {
+            continue;
+        }
+
+        compressed = (codec == COMPRESS_PLANES) ? compress_planes (sheet_patterns, pattern_count, &size)
+                                                : compress_zx7 (sheet_patterns, raw_size, &size);
+        if (compressed == NULL)
+        {
+            printf ("\n");
+            fprintf (stderr, "Error: Failed to compress patterns for %s.\n", sheet_name);
+            return RC_ERROR;
+        }
+
+        printf (", %s: %zu bytes (%.1f%%)", codec_name, size, 100.0 * size / raw_size);
+
+        snprintf (array, sizeof (array), "patterns_%s", codec_name);
+        int rc = mode4_write_compressed (pattern_file, sheet_name, array, compressed, size);
+        free (compressed);
+        if (rc != RC_OK)
+        {
+            printf ("\n");
+            return RC_ERROR;
+        }
+    }
+
+    printf ("\n");
     return RC_OK;
 }
 
 
+/*
+ * Write the run-length encoded indices of the current sheet, and report how well they compressed.
+ * The report is printed once the sheet's patterns are finished, so that it follows their report.
+ */
+static int mode4_compress_indices (const char *base_name, const uint16_t *tile_map, uint32_t count)
+{
+    uint8_t *compressed;
+    size_t size = 0;
+    int rc;
+
+    if (count == 0)
+    {
+        return RC_OK;
+    }
+
+    compressed = compress_indices_rle (tile_map, count, &size);
+    if (compressed == NULL)
+    {
+        fprintf (stderr, "Error: Failed to compress indices for %s.\n", base_name);
+        return RC_ERROR;
+    }
+
+    snprintf (indices_report, sizeof (indices_report), "%s: %u indices, %u bytes, rle: %zu bytes (%.1f%%)\n",
+              base_name, count, count * 2, size, 100.0 * size / (count * 2));
+
+    /* The decoder needs the count, without having to link in the uncompressed array.
+     * For binary output, it is defined along with the uncompressed indices. */
+    if (output_format == OUTPUT_FORMAT_C)
+    {
+        output_printf (pattern_index_file, "\n#define %s_indices_count %u\n", base_name, count);
+    }
+
+    rc = mode4_write_compressed (pattern_index_file, base_name, "indices_rle", compressed, size);
+    free (compressed);
+
+    return rc;
+}
+
+
+/*
+ * Finish the patterns of the current source file.
+ * For binary output, the header gives the location of the sheet's
+ * patterns within the pattern data that its indices refer to.
+ */
+static int mode4_end_patterns (void)
+{
+    int rc = RC_OK;
+
+    if (pattern_bin_error)
+    {
+        rc = RC_ERROR;
+    }
+    else if (!sheet_patterns_started)
+    {
+        /* An empty array is not valid C, so only give the count */
+        if (sheet_name != NULL)
+        {
+            output_printf (pattern_file, "\n/* %s adds no new patterns */\n", sheet_name);
+            output_printf (pattern_file, "#define %s_patterns_count 0\n", sheet_name);
+        }
+    }
+    else if (output_format == OUTPUT_FORMAT_BIN)
+    {
+        if (pattern_bin_file != NULL)
+        {
+            rc = output_close (pattern_bin_file);
+            pattern_bin_file = NULL;
+
+            output_printf (pattern_file, "\n/* %s_patterns.bin */\n", sheet_name);
+            output_printf (pattern_file, "#define %s_patterns_offset %u\n", sheet_name, sheet_first_pattern * 32);
+            output_printf (pattern_file, "#define %s_patterns_size %u\n", sheet_name,
+                           (pattern_index - sheet_first_pattern) * 32);
+        }
+    }
+    else
+    {
+        output_string (pattern_file, "};\n");
+    }
+
+    if (rc == RC_OK && compress_codecs != 0 && sheet_name != NULL)
+    {
+        rc = mode4_compress_patterns ();
+    }
+
+    if (rc == RC_OK)
+    {
+        fputs (indices_report, stdout);
+    }
+    indices_report [0] = '\0';
+
+    free (sheet_name);
+    sheet_name = NULL;
+
+    return rc;
+}
+
+
 /*
  * Mark the start of a new source file.
  */
-void mode4_new_input_file (const char *name)
+int mode4_new_input_file (const char *name)
 {
     static bool first = true;
     if (first)
     {
         first = false;
     }
-    else
+    else if (mode4_end_patterns () != RC_OK)
     {
-        fprintf (pattern_file, "};\n");
+        return RC_ERROR;
     }
 
     /* Strip the extension for the array name */
@@ -114,19 +330,69 @@ void mode4_new_input_file (const char *name)
         extension [0] = '\0';
     }
 
+    /* Pattern indices are within the current output array,
+     * or within the concatenation of all arrays for --dedup-global */
+    if (!dedup_global)
+    {
+        pattern_index = 0;
+    }
+
+    sheet_name = base_name;
+    sheet_first_pattern = pattern_index;
+    sheet_patterns_started = false;
+    pattern_bin_error = false;
+
+    return RC_OK;
+}
+
+
+/*
+ * Start the output of the current sheet's patterns, on its first new pattern.
+ */
+static void mode4_start_patterns (void)
+{
+    sheet_patterns_started = true;
+
+    if (output_format == OUTPUT_FORMAT_BIN)
+    {
+        /* Start new binary file, the header is written once its size is known */
+        pattern_bin_file = mode4_open_bin_file (sheet_name, "patterns");
+        pattern_bin_error = (pattern_bin_file == NULL);
+        return;
+    }
+
     /* Start new data array in patterns file */
-    fprintf (pattern_file, "\nconst uint32_t %s_patterns [] = {\n", base_name);
-    free (base_name);
+    output_printf (pattern_file, "\nconst uint32_t %s_patterns [] = {\n", sheet_name);
+}
+
+
+/*
+ * Write name-table entries to a binary file, and give its size in the index header.
+ * The caller has already written any defines that come before the size.
+ */
+static int mode4_write_indices_bin (const char *base_name, const char *suffix, const uint16_t *entries, uint32_t count)
+{
+    output_t *file = mode4_open_bin_file (base_name, suffix);
+    if (file == NULL)
+    {
+        return RC_ERROR;
+    }
 
-    /* Pattern indices are within the current output array */
-    pattern_index = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        output_le (file, entries [i], 2);
+    }
+
+    output_printf (pattern_index_file, "#define %s_%s_size %u\n", base_name, suffix, count * 2);
+
+    return output_close (file);
 }
 
 
 /*
  * Generate indices for the file.
  */
-void mode4_process_indices (const char *name, pixel_t *buffer)
+int mode4_process_indices (const char *name, uint16_t *tile_map)
 {
     /* Strip the extension for the array name */
     char *base_name = strdup (name);
@@ -136,31 +402,95 @@ void mode4_process_indices (const char *name, pixel_t *buffer)
         extension [0] = '\0';
     }
 
-    fprintf (pattern_index_file, "\nconst uint16_t %s_indices [%d] = {\n   ", base_name, (current_image.width / 8) * (current_image.height / 8));
+    if (compress_indices)
+    {
+        int rc = mode4_compress_indices (base_name, tile_map, (current_image.width / 8) * (current_image.height / 8));
+        if (rc != RC_OK)
+        {
+            free (base_name);
+            return rc;
+        }
+    }
+
+    if (output_format == OUTPUT_FORMAT_BIN)
+    {
+        output_printf (pattern_index_file, "\n/* %s_indices.bin */\n", base_name);
+        output_printf (pattern_index_file, "#define %s_indices_count %u\n", base_name,
+                 (current_image.width / 8) * (current_image.height / 8));
+
+        int rc = mode4_write_indices_bin (base_name, "indices", tile_map,
+                                          (current_image.width / 8) * (current_image.height / 8));
+        free (base_name);
+        return rc;
+    }
+
+    output_printf (pattern_index_file, "\nconst uint16_t %s_indices [%d] = {\n   ", base_name, (current_image.width / 8) * (current_image.height / 8));
     free (base_name);
 
     uint32_t tile_count = 0;
-    for (uint32_t row = 0; row < current_image.height; row += 8)
-    for (uint32_t col = 0; col < current_image.width; col += 8)
+    for (uint32_t i = 0; i < (current_image.width / 8) * (current_image.height / 8); i++)
     {
-        fprintf (pattern_index_file, " 0x%04x", sneptile_get_match (&buffer [row * current_image.width + col]));
-
-        fprintf (pattern_index_file, "%s", (tile_count == 11) ? ",\n   " : ",");
+        output_string (pattern_index_file, " ");
+        output_hex (pattern_index_file, tile_map [i], 4);
+        output_string (pattern_index_file, (tile_count == 11) ? ",\n   " : ",");
         tile_count = (tile_count + 1) % 12;
     }
     if (tile_count != 0)
     {
-        fprintf (pattern_index_file, "\n");
+        output_string (pattern_index_file, "\n");
     }
 
-    fprintf (pattern_index_file, "};\n");
+    output_string (pattern_index_file, "};\n");
+
+    return RC_OK;
+}
+
+
+/*
+ * Generate binary panel indices for the file, one panel after another.
+ */
+static int mode4_process_panels_bin (const char *base_name, uint32_t panel_count, uint32_t panel_width,
+                                     uint32_t panel_height, uint16_t *tile_map)
+{
+    uint32_t panel_size = panel_width * panel_height;
+    uint16_t *entries = malloc (panel_count * panel_size * sizeof (uint16_t));
+    uint32_t entry_count = 0;
+    int rc;
+
+    if (entries == NULL)
+    {
+        fprintf (stderr, "Error: Failed to allocate panels for %s.\n", base_name);
+        return RC_ERROR;
+    }
+
+    for (uint32_t panel_row = 0; panel_row < current_image.height && entry_count < panel_count * panel_size;
+         panel_row += 8 * panel_height)
+    for (uint32_t panel_col = 0; panel_col < current_image.width && entry_count < panel_count * panel_size;
+         panel_col += 8 * panel_width)
+    {
+        for (uint32_t row = panel_row; row < panel_row + panel_height * 8; row += 8)
+        for (uint32_t col = panel_col; col < panel_col + panel_width * 8; col += 8)
+        {
+            entries [entry_count++] = tile_map [(row / 8) * (current_image.width / 8) + col / 8];
+        }
+    }
+
+    output_printf (pattern_index_file, "\n/* %s_panels.bin */\n", base_name);
+    output_printf (pattern_index_file, "#define %s_panels_count %u\n", base_name, entry_count / panel_size);
+    output_printf (pattern_index_file, "#define %s_panel_size %u\n", base_name, panel_size * 2);
+
+    rc = mode4_write_indices_bin (base_name, "panels", entries, entry_count);
+
+    free (entries);
+    return rc;
 }
 
 
 /*
  * Generate panel indices for the file.
  */
-void mode4_process_panels (const char *name, uint32_t panel_count, uint32_t panel_width, uint32_t panel_height, pixel_t *buffer)
+int mode4_process_panels (const char *name, uint32_t panel_count, uint32_t panel_width, uint32_t panel_height,
+                          uint16_t *tile_map)
 {
     /* Strip the extension for the array name */
     char *base_name = strdup (name);
@@ -170,35 +500,44 @@ void mode4_process_panels (const char *name, uint32_t panel_count, uint32_t pane
         extension [0] = '\0';
     }
 
-    fprintf (pattern_index_file, "\nconst uint16_t %s_panels [%d] [%d] = {\n", base_name, panel_count, panel_width * panel_height);
+    if (output_format == OUTPUT_FORMAT_BIN)
+    {
+        int rc = mode4_process_panels_bin (base_name, panel_count, panel_width, panel_height, tile_map);
+        free (base_name);
+        return rc;
+    }
+
+    output_printf (pattern_index_file, "\nconst uint16_t %s_panels [%d] [%d] = {\n", base_name, panel_count, panel_width * panel_height);
     free (base_name);
 
     for (uint32_t panel_row = 0; panel_row < current_image.height; panel_row += 8 * panel_height)
     for (uint32_t panel_col = 0; panel_col < current_image.width; panel_col += 8 * panel_width)
     {
         uint32_t tile_count = 0;
-        fprintf (pattern_index_file, "    { ");
+        output_string (pattern_index_file, "    { ");
         for (uint32_t row = panel_row; row < panel_row + panel_height * 8; row += 8)
         for (uint32_t col = panel_col; col < panel_col + panel_width * 8; col += 8)
         {
-            fprintf (pattern_index_file, "0x%04x", sneptile_get_match (&buffer [row * current_image.width + col]));
+            output_hex (pattern_index_file, tile_map [(row / 8) * (current_image.width / 8) + col / 8], 4);
 
             if (!(row == panel_row + (panel_height - 1) * 8 &&
                   col == panel_col + (panel_width - 1) * 8))
             {
-                fprintf (pattern_index_file, "%s", (tile_count == 11) ? ",\n      " : ", ");
+                output_string (pattern_index_file, (tile_count == 11) ? ",\n      " : ", ");
             }
 
             tile_count = (tile_count + 1) % 12;
         }
-        fprintf (pattern_index_file, " }%s\n", (panel_count > 1) ? "," : "");
+        output_string (pattern_index_file, (panel_count > 1) ? " },\n" : " }\n");
 
         if (--panel_count == 0)
         {
             break;
         }
     }
-    fprintf (pattern_index_file, "};\n");
+    output_string (pattern_index_file, "};\n");
+
+    return RC_OK;
 }
 
 /*
@@ -216,6 +555,63 @@ static uint16_t mode4_sms_colour_to_gg (uint8_t sms_colour)
 }
 
 
+/*
+ * Write one palette as binary files, with SMS colours as bytes, and GG colours as 16-bit words.
+ */
+static int mode4_palette_write_bin_files (const char *name, const uint8_t *palette, uint32_t size)
+{
+    output_t *sms_file = mode4_open_bin_file (name, "palette");
+    output_t *gg_file = mode4_open_bin_file (name, "palette_gg");
+
+    if (sms_file == NULL || gg_file == NULL)
+    {
+        if (sms_file != NULL)
+        {
+            output_close (sms_file);
+        }
+        return RC_ERROR;
+    }
+
+    output_bytes (sms_file, palette, size);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        output_le (gg_file, mode4_sms_colour_to_gg (palette [i]), 2);
+    }
+
+    if (output_close (sms_file) != RC_OK || output_close (gg_file) != RC_OK)
+    {
+        return RC_ERROR;
+    }
+
+    return RC_OK;
+}
+
+
+/*
+ * Output the palette as binary files, and give their sizes in the palette file.
+ */
+static int mode4_palette_write_bin (void)
+{
+    if (mode4_palette_write_bin_files ("background", background_palette, background_palette_size) != RC_OK ||
+        mode4_palette_write_bin_files ("sprite", sprite_palette, sprite_palette_size) != RC_OK)
+    {
+        return RC_ERROR;
+    }
+
+    output_string (palette_file, "\n/* background_palette.bin, sprite_palette.bin (SMS)");
+    output_string (palette_file, "\n * background_palette_gg.bin, sprite_palette_gg.bin (GG) */\n");
+    output_string (palette_file, "#ifdef TARGET_SMS\n");
+    output_printf (palette_file, "#define background_palette_size %u\n", background_palette_size);
+    output_printf (palette_file, "#define sprite_palette_size %u\n", sprite_palette_size);
+    output_string (palette_file, "#elif defined (TARGET_GG)\n");
+    output_printf (palette_file, "#define background_palette_size %u\n", background_palette_size * 2);
+    output_printf (palette_file, "#define sprite_palette_size %u\n", sprite_palette_size * 2);
+    output_string (palette_file, "#endif\n");
+
+    return RC_OK;
+}
+
+
 /*
  * Output the palette file.
  */
@@ -229,37 +625,46 @@ static int mode4_palette_write (void)
         return RC_ERROR;
     }
 
+    if (output_format == OUTPUT_FORMAT_BIN)
+    {
+        return mode4_palette_write_bin ();
+    }
+
     /* SMS Palette */
-    fprintf (palette_file, "\n#ifdef TARGET_SMS\n");
+    output_string (palette_file, "\n#ifdef TARGET_SMS\n");
 
-    fprintf (palette_file, "static const uint8_t background_palette [16] = { ");
+    output_string (palette_file, "static const uint8_t background_palette [16] = { ");
     for (uint32_t i = 0; i < background_palette_size; i++)
     {
-        fprintf (palette_file, "0x%02x%s", background_palette [i], ((i + 1) < background_palette_size) ? ", " : " };\n");
+        output_hex (palette_file, background_palette [i], 2);
+        output_string (palette_file, ((i + 1) < background_palette_size) ? ", " : " };\n");
     }
 
-    fprintf (palette_file, "static const uint8_t sprite_palette [16] = { ");
+    output_string (palette_file, "static const uint8_t sprite_palette [16] = { ");
     for (uint32_t i = 0; i < sprite_palette_size; i++)
     {
-        fprintf (palette_file, "0x%02x%s", sprite_palette [i], ((i + 1) < sprite_palette_size) ? ", " : " };\n");
+        output_hex (palette_file, sprite_palette [i], 2);
+        output_string (palette_file, ((i + 1) < sprite_palette_size) ? ", " : " };\n");
     }
 
     /* GG Palette */
-    fprintf (palette_file, "#elif defined (TARGET_GG)\n");
+    output_string (palette_file, "#elif defined (TARGET_GG)\n");
 
-    fprintf (palette_file, "static const uint16_t background_palette [16] = { ");
+    output_string (palette_file, "static const uint16_t background_palette [16] = { ");
     for (uint32_t i = 0; i < background_palette_size; i++)
     {
-        fprintf (palette_file, "0x%04x%s", mode4_sms_colour_to_gg (background_palette [i]), ((i + 1) < background_palette_size) ? ", " : " };\n");
+        output_hex (palette_file, mode4_sms_colour_to_gg (background_palette [i]), 4);
+        output_string (palette_file, ((i + 1) < background_palette_size) ? ", " : " };\n");
     }
 
-    fprintf (palette_file, "static const uint16_t sprite_palette [16] = { ");
+    output_string (palette_file, "static const uint16_t sprite_palette [16] = { ");
     for (uint32_t i = 0; i < sprite_palette_size; i++)
     {
-        fprintf (palette_file, "0x%04x%s", mode4_sms_colour_to_gg (sprite_palette [i]), ((i + 1) < sprite_palette_size) ? ", " : " };\n");
+        output_hex (palette_file, mode4_sms_colour_to_gg (sprite_palette [i]), 4);
+        output_string (palette_file, ((i + 1) < sprite_palette_size) ? ", " : " };\n");
     }
 
-    fprintf (palette_file, "#endif\n");
+    output_string (palette_file, "#endif\n");
 
     return RC_OK;
 }
@@ -272,20 +677,41 @@ int mode4_close_files (void)
 {
     int rc;
 
-    /* First, write the completed palette to file */
+    /* First, write the completed palette to file.
+     * On failure, the files are left open to be discarded. */
     rc = mode4_palette_write ();
+    if (rc != RC_OK)
+    {
+        return rc;
+    }
 
     /* Pattern file */
-    fprintf (pattern_file, "};\n");
-    fclose (pattern_file);
+    if (mode4_end_patterns () != RC_OK)
+    {
+        rc = RC_ERROR;
+    }
+    if (output_close (pattern_file) != RC_OK)
+    {
+        rc = RC_ERROR;
+    }
     pattern_file = NULL;
 
     /* Pattern index file */
-    fclose (pattern_index_file);
+    if (output_close (pattern_index_file) != RC_OK)
+    {
+        rc = RC_ERROR;
+    }
     pattern_index_file = NULL;
 
+    free (sheet_patterns);
+    sheet_patterns = NULL;
+    sheet_patterns_capacity = 0;
+
     /* Palette file */
-    fclose (palette_file);
+    if (output_close (palette_file) != RC_OK)
+    {
+        rc = RC_ERROR;
+    }
     palette_file = NULL;
 
     return rc;
@@ -295,39 +721,97 @@ int mode4_close_files (void)
 /*
  * Add a colour to the palette.
  * Return the index of the newly added colour.
+ * Colours beyond the sixteenth are counted but not stored,
+ * the overflow is reported when the palette is written.
  */
 uint8_t mode4_palette_add_colour (palette_t palette, uint8_t colour)
 {
     if (palette == PALETTE_BACKGROUND)
     {
-        background_palette [background_palette_size] = colour;
+        if (background_palette_size < 16)
+        {
+            background_palette [background_palette_size] = colour;
+        }
         return background_palette_size++;
     }
     else
     {
-        sprite_palette [sprite_palette_size] = colour;
+        if (sprite_palette_size < 16)
+        {
+            sprite_palette [sprite_palette_size] = colour;
+        }
         return sprite_palette_size++;
     }
 }
 
 
 /*
- * Convert from pixel colour to palette index.
- * New colours are added to the palette as needed.
+ * Get the number of colours that have been added to the palette.
  */
-static uint8_t mode4_rgb_to_index (palette_t palette, pixel_t p)
+uint32_t mode4_palette_size (palette_t palette)
 {
-    /* First, convert the pixel to a 6-bit Master System colour. */
-    uint8_t colour = ((p.r & 0xc0) >> 6)
-                   | ((p.g & 0xc0) >> 4)
-                   | ((p.b & 0xc0) >> 2);
+    return (palette == PALETTE_BACKGROUND) ? background_palette_size : sprite_palette_size;
+}
+
 
-    /* Next, check if the colour is already in the palette */
+/*
+ * Get the 6-bit colour of each of the 16 palette entries.
+ * Entries that have not been assigned are zero.
+ */
+void mode4_palette_get_colours (palette_t palette, uint8_t *colours)
+{
+    memset (colours, 0, 16);
+
+    if (palette == PALETTE_BACKGROUND)
+    {
+        memcpy (colours, background_palette, (background_palette_size < 16) ? background_palette_size : 16);
+    }
+    else
+    {
+        memcpy (colours, sprite_palette, (sprite_palette_size < 16) ? sprite_palette_size : 16);
+    }
+}
+
+
+/*
+ * Convert from pixel colour to a 6-bit Master System colour.
+ */
+uint8_t mode4_pixel_to_colour (pixel_t p)
+{
+    return ((p.r & 0xc0) >> 6)
+         | ((p.g & 0xc0) >> 4)
+         | ((p.b & 0xc0) >> 2);
+}
+
+
+/*
+ * Convert from a 6-bit Master System colour to an opaque pixel colour.
+ */
+pixel_t mode4_colour_to_pixel (uint8_t colour)
+{
+    pixel_t p = {
+        .r = ((colour >> 0) & 0x03) * 0x55,
+        .g = ((colour >> 2) & 0x03) * 0x55,
+        .b = ((colour >> 4) & 0x03) * 0x55,
+        .a = 0xff
+    };
+
+    return p;
+}
+
+
+/*
+ * Convert from a 6-bit Master System colour to palette index.
+ * New colours are added to the palette as needed.
+ */
+uint8_t mode4_colour_to_index (palette_t palette, uint8_t colour)
+{
+    /* Check if the colour is already in the palette */
     uint32_t start = (target == VDP_MODE_4_SPRITES) ? 1 : 0;
 
     if (palette == PALETTE_BACKGROUND)
     {
-        for (uint32_t i = start; i < background_palette_size; i++)
+        for (uint32_t i = start; i < background_palette_size && i < 16; i++)
         {
             if (background_palette [i] == colour)
             {
@@ -337,7 +821,7 @@ static uint8_t mode4_rgb_to_index (palette_t palette, pixel_t p)
     }
     else
     {
-        for (uint32_t i = start; i < sprite_palette_size; i++)
+        for (uint32_t i = start; i < sprite_palette_size && i < 16; i++)
         {
             if (sprite_palette [i] == colour)
             {
@@ -352,25 +836,18 @@ static uint8_t mode4_rgb_to_index (palette_t palette, pixel_t p)
 
 
 /*
- * Process a single 8×8 tile.
+ * Convert a single 8×8 tile of palette indices to its 32-byte bitplane representation.
  */
-void mode4_process_tile (palette_t palette, pixel_t *buffer)
+void mode4_indices_to_pattern (const uint8_t *indices, uint8_t *pattern)
 {
-    fprintf (pattern_file, "    ");
     for (uint32_t y = 0; y < 8; y++)
     {
-        uint8_t line_data[4] = { };
+        uint8_t *line_data = &pattern [y * 4];
+        memset (line_data, 0, 4);
 
         for (uint32_t x = 0; x < 8; x++)
         {
-            uint8_t index = 0;
-            pixel_t p = buffer [x + y * current_image.width];
-
-            /* If the pixel is non-transparent, calculate its colour index */
-            if (p.a != 0)
-            {
-                index = mode4_rgb_to_index (palette, p);
-            }
+            uint8_t index = indices [x + y * 8];
 
             /* Convert index to bitplane representation */
             for (uint32_t i = 0; i < 4; i++)
@@ -381,15 +858,61 @@ void mode4_process_tile (palette_t palette, pixel_t *buffer)
                 }
             }
         }
+    }
+}
+
+
+/*
+ * Output a single 8×8 pattern to the pattern file.
+ * Returns the pattern's index.
+ */
+int32_t mode4_process_tile (const uint8_t *pattern)
+{
+    /* Keep a copy of the sheet's patterns to compress once the sheet is complete.
+     * An allocation failure is reported when the sheet's patterns are finished. */
+    if (compress_codecs != 0 && !sheet_patterns_error)
+    {
+        uint32_t count = pattern_index - sheet_first_pattern;
+
+        if (count == sheet_patterns_capacity)
+        {
+            uint32_t capacity = (sheet_patterns_capacity == 0) ? 256 : sheet_patterns_capacity * 2;
+            uint8_t *patterns = realloc (sheet_patterns, capacity * 32);
+            if (patterns == NULL)
+            {
+                sheet_patterns_error = true;
+                return pattern_index++;
+            }
+            sheet_patterns = patterns;
+            sheet_patterns_capacity = capacity;
+        }
 
-        fprintf (pattern_file, "0x%02x%02x%02x%02x%s",
-                 line_data [3], line_data [2], line_data [1], line_data [0],
-                 (y < 7) ? ", " : ",\n");
+        memcpy (&sheet_patterns [count * 32], pattern, 32);
     }
 
-    pattern_index++;
-}
+    if (!sheet_patterns_started)
+    {
+        mode4_start_patterns ();
+    }
 
+    if (output_format == OUTPUT_FORMAT_BIN)
+    {
+        /* Each line is already in VDP order, one byte per bitplane */
+        if (pattern_bin_file != NULL)
+        {
+            output_bytes (pattern_bin_file, pattern, 32);
+        }
+        return pattern_index++;
+    }
 
+    output_string (pattern_file, "    ");
+    for (uint32_t y = 0; y < 8; y++)
+    {
+        const uint8_t *line_data = &pattern [y * 4];
 
+        output_hex (pattern_file, (uint32_t) line_data [3] << 24 | line_data [2] << 16 | line_data [1] << 8 | line_data [0], 8);
+        output_string (pattern_file, (y < 7) ? ", " : ",\n");
+    }
 
+    return pattern_index++;
+}
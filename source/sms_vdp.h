@@ -17,14 +17,33 @@ int mode4_close_files (void);
 /* Add a colour to the palette. */
 uint8_t mode4_palette_add_colour (palette_t palette, uint8_t colour);
 
+/* Get the number of colours that have been added to the palette. */
+uint32_t mode4_palette_size (palette_t palette);
+
+/* Get the 6-bit colour of each of the 16 palette entries. */
+void mode4_palette_get_colours (palette_t palette, uint8_t *colours);
+
 /* Mark the start of a new source file. */
-void mode4_new_input_file (const char *name);
+int mode4_new_input_file (const char *name);
+
+/* Convert from pixel colour to a 6-bit Master System colour. */
+uint8_t mode4_pixel_to_colour (pixel_t p);
+
+/* Convert from a 6-bit Master System colour to an opaque pixel colour. */
+pixel_t mode4_colour_to_pixel (uint8_t colour);
+
+/* Convert from a 6-bit Master System colour to palette index. */
+uint8_t mode4_colour_to_index (palette_t palette, uint8_t colour);
+
+/* Convert a single 8×8 tile of palette indices to its 32-byte bitplane representation. */
+void mode4_indices_to_pattern (const uint8_t *indices, uint8_t *pattern);
 
-/* Process a single 8×8 tile. */
-void mode4_process_tile (palette_t palette, pixel_t *buffer);
+/* Output a single 8×8 pattern to the pattern file. */
+int32_t mode4_process_tile (const uint8_t *pattern);
 
 /* Generate indices for the file. */
-void mode4_process_indices (const char *name, pixel_t *buffer);
+int mode4_process_indices (const char *name, uint16_t *tile_map);
 
 /* Generate panel indexes for the file. */
-void mode4_process_panels (const char *name, uint32_t panel_count, uint32_t panel_width, uint32_t panel_height, pixel_t *buffer);
+int mode4_process_panels (const char *name, uint32_t panel_count, uint32_t panel_width, uint32_t panel_height,
+                          uint16_t *tile_map);
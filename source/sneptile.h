@@ -23,9 +23,18 @@ typedef enum target_e {
     VDP_MODE_4_SPRITES,
 } target_t;
 
+typedef enum output_format_e {
+    OUTPUT_FORMAT_C = 0,    /* C arrays in header files */
+    OUTPUT_FORMAT_BIN,      /* Raw VDP data, with headers giving the sizes */
+} output_format_t;
+
 /* Global State */
 extern target_t target;
 extern char *output_dir;
+extern bool dedup_global;
+extern bool dedup_flips;
+extern bool dedup_tms;
+extern output_format_t output_format;
 
 /* Current image file */
 typedef struct image_s {
@@ -34,5 +43,9 @@ typedef struct image_s {
 } image_t;
 extern image_t current_image;
 
-/* Find the matching 8x8 tile, or -1 if it is unique. */
-int32_t sneptile_get_match (pixel_t *tile);
+/* Size of the VDP representation used to de-duplicate a tile */
+#define PATTERN_KEY_SIZE 32
+
+/* Mode-4 name-table flip bits */
+#define TILE_FLIP_H 0x0200
+#define TILE_FLIP_V 0x0400
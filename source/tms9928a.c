@@ -5,12 +5,16 @@
 
 #define _GNU_SOURCE
 #include <ctype.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "sneptile.h"
+#include "output.h"
+#include "tms9928a.h"
 
 /* State */
 static uint32_t pattern_index = 0;
@@ -29,9 +33,14 @@ static uint8_t test_ct_entry [2] = { };
 static uint32_t test_ct_entry_size = 0;
 
 /* Mode-4 Output Files */
-static FILE *pattern_file = NULL;
-static FILE *pattern_index_file = NULL;
-static FILE *colour_table_file = NULL;
+static output_t *pattern_file = NULL;
+static output_t *pattern_index_file = NULL;
+static output_t *colour_table_file = NULL;
+
+/* Binary output, for --format bin */
+static const char *patterns_name = "patterns";
+static output_t *pattern_bin_file = NULL;
+static output_t *colour_table_bin_file = NULL;
 
 /* TMS9928a palette (gamma corrected) */
 static const pixel_t tms9928a_palette [16] = {
@@ -61,57 +70,55 @@ int tms9928a_open_files (void)
 {
     char *patterns_path = "patterns.h";
     char *pattern_index_path = "pattern_index.h";
-    char *colour_table_path = "colour_table.h";
 
     /* Give sprite modes a different name, so that
      * they can be used in the same project alongside
      * background tiles. */
     if (target == VDP_MODE_TMS_SMALL_SPRITES)
     {
+        patterns_name = "sprites";
         patterns_path = "sprites.h";
         pattern_index_path = "sprite_index.h";
     }
     else if (target == VDP_MODE_TMS_LARGE_SPRITES)
     {
+        patterns_name = "sprites_l";
         patterns_path = "sprites_l.h";
         pattern_index_path = "sprite_index_l.h";
     }
 
-    /* If the user has specified an output
-     * directory, create and change into it */
-    if (output_dir != NULL)
-    {
-        asprintf (&patterns_path, "%s/%s", output_dir, patterns_path);
-        asprintf (&pattern_index_path, "%s/%s", output_dir, pattern_index_path);
-        asprintf (&colour_table_path, "%s/%s", output_dir, colour_table_path);
-    }
-
     /* Pattern file */
-    pattern_file = fopen (patterns_path, "w");
+    pattern_file = output_open (patterns_path, "w");
     if (pattern_file == NULL)
     {
-        fprintf (stderr, "Unable to open output file patterns.h\n");
         return RC_ERROR;
     }
 
-    if (target == VDP_MODE_TMS_SMALL_SPRITES)
+    if (output_format == OUTPUT_FORMAT_BIN)
     {
-        fprintf (pattern_file, "static const uint32_t sprites [] = {\n");
-    }
-    else if (target == VDP_MODE_TMS_LARGE_SPRITES)
-    {
-        fprintf (pattern_file, "static const uint32_t sprites_l [] = {\n");
+        /* The header only gives the size, which is written once all patterns are known */
+        char *bin_path = NULL;
+        if (asprintf (&bin_path, "%s.bin", patterns_name) < 0)
+        {
+            fprintf (stderr, "Error: Failed to allocate file name for %s.\n", patterns_name);
+            return RC_ERROR;
+        }
+        pattern_bin_file = output_open (bin_path, "wb");
+        free (bin_path);
+        if (pattern_bin_file == NULL)
+        {
+            return RC_ERROR;
+        }
     }
     else
     {
-        fprintf (pattern_file, "static const uint32_t patterns [] = {\n");
+        output_printf (pattern_file, "static const uint32_t %s [] = {\n", patterns_name);
     }
 
     /* Pattern index file */
-    pattern_index_file = fopen (pattern_index_path, "w");
+    pattern_index_file = output_open (pattern_index_path, "w");
     if (pattern_index_file == NULL)
     {
-        fprintf (stderr, "Unable to open output file pattern_index.h\n");
         return RC_ERROR;
     }
 
@@ -119,20 +126,24 @@ int tms9928a_open_files (void)
     if (target == VDP_MODE_0 || target == VDP_MODE_2)
     {
         /* Colour table file */
-        colour_table_file = fopen (colour_table_path, "w");
+        colour_table_file = output_open ("colour_table.h", "w");
         if (colour_table_file == NULL)
         {
-            fprintf (stderr, "Unable to open output file colour_table.h\n");
             return RC_ERROR;
         }
-        fprintf (colour_table_file, "static const %s colour_table [] = {\n", (target == VDP_MODE_0) ? "uint8_t" : "uint32_t");
-    }
 
-    if (output_dir != NULL)
-    {
-        free (patterns_path);
-        free (pattern_index_path);
-        free (colour_table_path);
+        if (output_format == OUTPUT_FORMAT_BIN)
+        {
+            colour_table_bin_file = output_open ("colour_table.bin", "wb");
+            if (colour_table_bin_file == NULL)
+            {
+                return RC_ERROR;
+            }
+        }
+        else
+        {
+            output_printf (colour_table_file, "static const %s colour_table [] = {\n", (target == VDP_MODE_0) ? "uint8_t" : "uint32_t");
+        }
     }
 
     return RC_OK;
@@ -144,18 +155,25 @@ int tms9928a_open_files (void)
  */
 static void tms9928a_emit_pattern (uint8_t *pattern_lines)
 {
+    if (pattern_bin_file != NULL)
+    {
+        output_bytes (pattern_bin_file, pattern_lines, 8);
+        return;
+    }
+
     /* Indent at the start of each line, plus spaces between 4-byte words. */
-    fprintf (pattern_file, "%s", line_pattern_index == 0 ? "    " : " ");
+    output_string (pattern_file, line_pattern_index == 0 ? "    " : " ");
 
-    fprintf (pattern_file, "0x%02x%02x%02x%02x, 0x%02x%02x%02x%02x,",
-             pattern_lines [3], pattern_lines [2], pattern_lines [1], pattern_lines [0],
-             pattern_lines [7], pattern_lines [6], pattern_lines [5], pattern_lines [4]);
+    output_hex (pattern_file, (uint32_t) pattern_lines [3] << 24 | pattern_lines [2] << 16 | pattern_lines [1] << 8 | pattern_lines [0], 8);
+    output_string (pattern_file, ", ");
+    output_hex (pattern_file, (uint32_t) pattern_lines [7] << 24 | pattern_lines [6] << 16 | pattern_lines [5] << 8 | pattern_lines [4], 8);
+    output_string (pattern_file, ",");
 
     line_pattern_index++;
 
     if (line_pattern_index == 4)
     {
-        fprintf (pattern_file, "\n");
+        output_string (pattern_file, "\n");
         line_pattern_index = 0;
     }
 }
@@ -166,15 +184,22 @@ static void tms9928a_emit_pattern (uint8_t *pattern_lines)
  */
 static void tms9928a_mode0_emit_ct_entry (void)
 {
+    if (colour_table_bin_file != NULL)
+    {
+        output_le (colour_table_bin_file, (ct_entry [0] & 0x0f) | ((ct_entry [1] << 4) & 0xf0), 1);
+        return;
+    }
+
     /* Eight entries per line. Indent at the start of each line, plus spaces between entries. */
-    fprintf (colour_table_file, "%s", line_ct_index == 0 ? "    " : " ");
+    output_string (colour_table_file, line_ct_index == 0 ? "    " : " ");
 
-    fprintf (colour_table_file, "0x%02x,", (ct_entry [0] & 0x0f) | ((ct_entry [1] << 4) & 0xf0));
+    output_hex (colour_table_file, (ct_entry [0] & 0x0f) | ((ct_entry [1] << 4) & 0xf0), 2);
+    output_string (colour_table_file, ",");
     line_ct_index++;
 
     if (line_ct_index == 8)
     {
-        fprintf (colour_table_file, "\n");
+        output_string (colour_table_file, "\n");
         line_ct_index = 0;
     }
 }
@@ -185,18 +210,25 @@ static void tms9928a_mode0_emit_ct_entry (void)
  */
 static void tms9928a_mode2_emit_ct_entry (uint8_t *ct_lines)
 {
+    if (colour_table_bin_file != NULL)
+    {
+        output_bytes (colour_table_bin_file, ct_lines, 8);
+        return;
+    }
+
     /* Indent at the start of each line, plus spaces between 4-byte words. */
-    fprintf (colour_table_file, "%s", line_ct_index == 0 ? "    " : " ");
+    output_string (colour_table_file, line_ct_index == 0 ? "    " : " ");
 
-    fprintf (colour_table_file, "0x%02x%02x%02x%02x, 0x%02x%02x%02x%02x,",
-             ct_lines [3], ct_lines [2], ct_lines [1], ct_lines [0],
-             ct_lines [7], ct_lines [6], ct_lines [5], ct_lines [4]);
+    output_hex (colour_table_file, (uint32_t) ct_lines [3] << 24 | ct_lines [2] << 16 | ct_lines [1] << 8 | ct_lines [0], 8);
+    output_string (colour_table_file, ", ");
+    output_hex (colour_table_file, (uint32_t) ct_lines [7] << 24 | ct_lines [6] << 16 | ct_lines [5] << 8 | ct_lines [4], 8);
+    output_string (colour_table_file, ",");
 
     line_ct_index++;
 
     if (line_ct_index == 4)
     {
-        fprintf (colour_table_file, "\n");
+        output_string (colour_table_file, "\n");
         line_ct_index = 0;
     }
 }
@@ -207,13 +239,34 @@ static void tms9928a_mode2_emit_ct_entry (uint8_t *ct_lines)
  */
 int tms9928a_close_files (void)
 {
+    int rc = RC_OK;
+
     /* Pattern file */
-    fprintf (pattern_file, "%s};\n", line_pattern_index != 0 ? "\n" : "");
-    fclose (pattern_file);
+    if (pattern_bin_file != NULL)
+    {
+        output_printf (pattern_file, "/* %s.bin */\n", patterns_name);
+        output_printf (pattern_file, "#define %s_size %" PRIu64 "\n", patterns_name, output_size (pattern_bin_file));
+        if (output_close (pattern_bin_file) != RC_OK)
+        {
+            rc = RC_ERROR;
+        }
+        pattern_bin_file = NULL;
+    }
+    else
+    {
+        output_string (pattern_file, line_pattern_index != 0 ? "\n};\n" : "};\n");
+    }
+    if (output_close (pattern_file) != RC_OK)
+    {
+        rc = RC_ERROR;
+    }
     pattern_file = NULL;
 
     /* Pattern index file */
-    fclose (pattern_index_file);
+    if (output_close (pattern_index_file) != RC_OK)
+    {
+        rc = RC_ERROR;
+    }
     pattern_index_file = NULL;
 
     if (colour_table_file != NULL)
@@ -224,12 +277,28 @@ int tms9928a_close_files (void)
             tms9928a_mode0_emit_ct_entry ();
         }
 
-        fprintf (colour_table_file, "%s};\n", line_ct_index != 0 ? "\n" : "");
-        fclose (colour_table_file);
+        if (colour_table_bin_file != NULL)
+        {
+            output_string (colour_table_file, "/* colour_table.bin */\n");
+            output_printf (colour_table_file, "#define colour_table_size %" PRIu64 "\n", output_size (colour_table_bin_file));
+            if (output_close (colour_table_bin_file) != RC_OK)
+            {
+                rc = RC_ERROR;
+            }
+            colour_table_bin_file = NULL;
+        }
+        else
+        {
+            output_string (colour_table_file, line_ct_index != 0 ? "\n};\n" : "};\n");
+        }
+        if (output_close (colour_table_file) != RC_OK)
+        {
+            rc = RC_ERROR;
+        }
         colour_table_file = NULL;
     }
 
-    return RC_OK;
+    return rc;
 }
 
 
@@ -241,18 +310,21 @@ void tms9928a_new_input_first_tile (void)
     const char *name = input_filename;
 
     /* Mark in patterns file */
-    fprintf (pattern_file, "%s\n    /* %s */\n", line_pattern_index != 0 ? "\n" : "", name);
+    if (pattern_bin_file == NULL)
+    {
+        output_printf (pattern_file, "%s\n    /* %s */\n", line_pattern_index != 0 ? "\n" : "", name);
+    }
     line_pattern_index = 0;
 
-    if (target == VDP_MODE_2)
+    if (target == VDP_MODE_2 && colour_table_bin_file == NULL)
     {
         /* Mark in colour-table file */
-        fprintf (colour_table_file, "%s\n    /* %s */\n", line_ct_index != 0 ? "\n" : "", name);
+        output_printf (colour_table_file, "%s\n    /* %s */\n", line_ct_index != 0 ? "\n" : "", name);
         line_ct_index = 0;
     }
 
     /* Generate pattern index define */
-    fprintf (pattern_index_file, "#define PATTERN_");
+    output_string (pattern_index_file, "#define PATTERN_");
 
     for (char c = *name; *name != '\0'; c = *++name)
     {
@@ -266,10 +338,11 @@ void tms9928a_new_input_first_tile (void)
             c = '_';
         }
 
-        fprintf (pattern_index_file, "%c", toupper(c));
+        c = toupper (c);
+        output_bytes (pattern_index_file, &c, 1);
     }
 
-    fprintf (pattern_index_file, " %d\n", pattern_index);
+    output_printf (pattern_index_file, " %d\n", pattern_index);
 
     first_pattern_in_file = false;
 }
@@ -291,11 +364,10 @@ void tms9928a_new_input_file (const char *name)
 /*
  * Convert from pixel colour to the indexed tms9928a colour.
  * Assumes that the input is using the gamma-corrected values.
+ * Returns TMS9928A_INVALID_COLOUR for a non-compatible colour.
  */
-static uint8_t tms9928a_rgb_to_colour_index (pixel_t p)
+uint8_t tms9928a_rgb_to_colour_index (pixel_t p)
 {
-    static bool warn_once = true;
-
     if (p.a != 0)
     {
         /* Map from RGB to tms9928a colour */
@@ -309,28 +381,56 @@ static uint8_t tms9928a_rgb_to_colour_index (pixel_t p)
             }
         }
 
+        return TMS9928A_INVALID_COLOUR;
+    }
+
+    /* Zero for transparency */
+    return 0;
+}
+
+
+/*
+ * Convert from a tms9928a colour to its pixel colour, with colour 0 transparent.
+ */
+pixel_t tms9928a_colour_to_pixel (uint8_t colour)
+{
+    pixel_t p = tms9928a_palette [colour & 0x0f];
+    p.a = (colour == 0) ? 0x00 : 0xff;
+
+    return p;
+}
+
+
+/*
+ * Check a colour from tms9928a_rgb_to_colour_index.
+ * Non-compatible colours are treated as transparent.
+ */
+uint8_t tms9928a_check_colour (uint8_t colour)
+{
+    static bool warn_once = true;
+
+    if (colour == TMS9928A_INVALID_COLOUR)
+    {
         /* Warn if a non-compatible colour is used. */
         if (warn_once)
         {
             fprintf (stderr, "Warning: Image contains invalid colours for tms9928a.\n");
             warn_once = false;
         }
+        return 0;
     }
 
-    /* Zero for transparency */
-    return 0;
+    return colour;
 }
 
 
 /*
- * Convert from pixel colour to tms9928a pattern bit.
+ * Convert from tms9928a colour to tms9928a pattern bit.
  * Returns 0 for background colour.
  * Returns 1 for foreground colour.
  */
-static uint8_t tms9928a_rgb_to_ct_bit (pixel_t p)
+static uint8_t tms9928a_colour_to_ct_bit (uint8_t colour)
 {
-    uint8_t colour = tms9928a_rgb_to_colour_index (p);
-
     /* For sprites, all we care about is whether the pixel is transparent or not */
     if (target == VDP_MODE_TMS_SMALL_SPRITES || target == VDP_MODE_TMS_LARGE_SPRITES)
     {
@@ -357,7 +457,7 @@ static uint8_t tms9928a_rgb_to_ct_bit (pixel_t p)
  * Generate a one-tile colour-table entry, used for checking
  * compatibility within a mode-0 block of eight.
  */
-static void tms9928a_generate_ct_test_entry (pixel_t *buffer, uint32_t stride, uint32_t lines)
+static void tms9928a_generate_ct_test_entry (const uint8_t *colours, uint32_t stride, uint32_t lines)
 {
     test_ct_entry_size = 0;
 
@@ -365,10 +465,7 @@ static void tms9928a_generate_ct_test_entry (pixel_t *buffer, uint32_t stride, u
     {
         for (uint32_t x = 0; x < 8; x++)
         {
-            uint8_t colour = 0;
-            pixel_t p = buffer [x + y * stride];
-
-            colour = tms9928a_rgb_to_colour_index (p);
+            uint8_t colour = colours [x + y * stride];
 
             /* Check if the colour is already in the colour-table byte */
             if ((test_ct_entry_size >= 1 && colour == test_ct_entry [0]) ||
@@ -431,9 +528,10 @@ static bool tms9928a_check_ct_compatible (void)
 
 
 /*
- * Process a single 8×8 tile.
+ * Process a single 8×8 tile, given as tms9928a colours.
+ * Returns the pattern's index, or -1 if the tile is not valid for the mode.
  */
-static void tms9928a_process_tile_8 (pixel_t *buffer, uint32_t stride)
+static int32_t tms9928a_process_tile_8 (const uint8_t *colours, uint32_t stride)
 {
     uint8_t pattern_lines [8] = { };
     uint8_t pattern_colours [8] = { }; /* For mode-2 */
@@ -442,13 +540,13 @@ static void tms9928a_process_tile_8 (pixel_t *buffer, uint32_t stride)
     {
         /* First, generate the palette we'd need for this tile so that
          * we can check it against the limitations of the mode-0. */
-        tms9928a_generate_ct_test_entry (buffer, stride, 8);
+        tms9928a_generate_ct_test_entry (colours, stride, 8);
 
         /* In mode-0, each tile is allowed only two colours. */
         if (test_ct_entry_size > 2)
         {
             fprintf (stderr, "Error: Tile contains too many colours for mode-0.\n");
-            return;
+            return -1;
         }
 
         /* If the colours are not compatible, we need to emit dummy
@@ -475,19 +573,18 @@ static void tms9928a_process_tile_8 (pixel_t *buffer, uint32_t stride)
         if (target == VDP_MODE_2)
         {
             /* Check if this line contains more than two colours. */
-            tms9928a_generate_ct_test_entry (&buffer [y * stride], stride, 1);
+            tms9928a_generate_ct_test_entry (&colours [y * stride], stride, 1);
             if (test_ct_entry_size > 2)
             {
                 fprintf (stderr, "Error: Line contains too many colours for mode-0.\n");
-                return;
+                return -1;
             }
             ct_entry_size = 0;
         }
 
         for (uint32_t x = 0; x < 8; x++)
         {
-            pixel_t p = buffer [x + y * stride];
-            uint8_t bit = tms9928a_rgb_to_ct_bit (p);
+            uint8_t bit = tms9928a_colour_to_ct_bit (colours [x + y * stride]);
 
             /* Convert to 1-bit-per-pixel representation */
             if (bit)
@@ -524,30 +621,153 @@ static void tms9928a_process_tile_8 (pixel_t *buffer, uint32_t stride)
         tms9928a_mode2_emit_ct_entry (pattern_colours);
     }
 
-    pattern_index++;
+    return pattern_index++;
 }
 
 
 /*
- * Process a single tile.
+ * Process a single tile, given as tms9928a colours.
  * The tile size is 8×8 for the tile-map and small sprites.
  * The tile size is 16×16 for large sprites.
+ * Returns the index of the tile's first pattern, or -1 if the tile is not valid for the mode.
  */
-void tms9928a_process_tile (pixel_t *buffer)
+int32_t tms9928a_process_tile (const uint8_t *colours)
 {
-    uint32_t stride = current_image.width;
-
     if (target == VDP_MODE_TMS_LARGE_SPRITES)
     {
         /* Sprite layout: 0 2
          *                1 3 */
-        tms9928a_process_tile_8 (&buffer [0             ], stride);
-        tms9928a_process_tile_8 (&buffer [0 + 8 * stride], stride);
-        tms9928a_process_tile_8 (&buffer [8             ], stride);
-        tms9928a_process_tile_8 (&buffer [8 + 8 * stride], stride);
+        int32_t index = tms9928a_process_tile_8 (&colours [0          ], 16);
+        if (index == -1 ||
+            tms9928a_process_tile_8 (&colours [0 + 8 * 16], 16) == -1 ||
+            tms9928a_process_tile_8 (&colours [8          ], 16) == -1 ||
+            tms9928a_process_tile_8 (&colours [8 + 8 * 16], 16) == -1)
+        {
+            return -1;
+        }
+        return index;
     }
     else
     {
-        tms9928a_process_tile_8 (buffer, stride);
+        return tms9928a_process_tile_8 (colours, 8);
+    }
+}
+
+
+/*
+ * Generate the key used to de-duplicate a tile.
+ *
+ * For sprites, this is the bitmap of non-transparent pixels.
+ *
+ * For mode-0 and mode-2, this is the tms9928a colour of each pixel. Two tiles
+ * with the same colours will generate the same pattern and colour-table lines,
+ * and a generated pattern's colour-table entry never changes the colours of
+ * the pixels it has already been used for. So in mode-2, matching tiles share
+ * both the pattern and its colour-table lines, and in mode-0 they share the
+ * pattern and the colour-table entry of its group of eight.
+ */
+void tms9928a_tile_to_key (const uint8_t *colours, uint8_t *key)
+{
+    uint32_t size = (target == VDP_MODE_TMS_LARGE_SPRITES) ? 16 : 8;
+
+    memset (key, 0, PATTERN_KEY_SIZE);
+
+    for (uint32_t y = 0; y < size; y++)
+    {
+        for (uint32_t x = 0; x < size; x++)
+        {
+            uint8_t colour = colours [x + y * size];
+
+            if (target == VDP_MODE_TMS_SMALL_SPRITES || target == VDP_MODE_TMS_LARGE_SPRITES)
+            {
+                if (colour != 0)
+                {
+                    key [(y * size + x) / 8] |= (1 << (7 - (x % 8)));
+                }
+            }
+            else
+            {
+                key [(y * 8 + x) / 2] |= colour << ((x % 2) ? 0 : 4);
+            }
+        }
+    }
+}
+
+
+/*
+ * Write the indices for the file to a binary file, and give its size in the index header.
+ */
+static int tms9928a_process_indices_bin (const char *base_name, uint16_t *tile_map, uint32_t count)
+{
+    char *file_name = NULL;
+    output_t *file;
+
+    if (asprintf (&file_name, "%s_indices.bin", base_name) < 0)
+    {
+        fprintf (stderr, "Error: Failed to allocate file name for %s.\n", base_name);
+        return RC_ERROR;
+    }
+    file = output_open (file_name, "wb");
+    free (file_name);
+    if (file == NULL)
+    {
+        return RC_ERROR;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        output_le (file, tile_map [i], 2);
+    }
+
+    output_printf (pattern_index_file, "\n/* %s_indices.bin */\n", base_name);
+    output_printf (pattern_index_file, "#define %s_indices_count %u\n", base_name, count);
+    output_printf (pattern_index_file, "#define %s_indices_size %u\n", base_name, count * 2);
+
+    return output_close (file);
+}
+
+
+/*
+ * Generate indices for the file.
+ */
+int tms9928a_process_indices (const char *name, uint16_t *tile_map)
+{
+    uint32_t tile_size = (target == VDP_MODE_TMS_LARGE_SPRITES) ? 16 : 8;
+
+    /* Strip the extension for the array name */
+    char *base_name = strdup (name);
+    char *extension = strchr (base_name, '.');
+    if (extension)
+    {
+        extension [0] = '\0';
+    }
+
+    if (output_format == OUTPUT_FORMAT_BIN)
+    {
+        int rc = tms9928a_process_indices_bin (base_name, tile_map,
+                                               (current_image.width / tile_size) * (current_image.height / tile_size));
+        free (base_name);
+        return rc;
     }
+
+    output_printf (pattern_index_file, "\nconst uint16_t %s_indices [%d] = {\n   ", base_name,
+                   (current_image.width / tile_size) * (current_image.height / tile_size));
+    free (base_name);
+
+    uint32_t tile_count = 0;
+    for (uint32_t i = 0; i < (current_image.width / tile_size) * (current_image.height / tile_size); i++)
+    {
+        output_string (pattern_index_file, " ");
+        output_hex (pattern_index_file, tile_map [i], 4);
+        output_string (pattern_index_file, (tile_count == 11) ? ",\n   " : ",");
+        tile_count = (tile_count + 1) % 12;
+    }
+    if (tile_count != 0)
+    {
+        output_string (pattern_index_file, "\n");
+    }
+
+    output_string (pattern_index_file, "};\n");
+
+    return RC_OK;
 }
@@ -12,5 +12,23 @@ int tms9928a_close_files (void);
 /* Mark the start of a new source file. */
 void tms9928a_new_input_file (const char *name);
 
-/* Process a single tile. */
-void tms9928a_process_tile (pixel_t *buffer);
+/* Returned by tms9928a_rgb_to_colour_index for a non-compatible colour */
+#define TMS9928A_INVALID_COLOUR 0x10
+
+/* Convert from pixel colour to the indexed tms9928a colour. */
+uint8_t tms9928a_rgb_to_colour_index (pixel_t p);
+
+/* Convert from a tms9928a colour to its pixel colour, with colour 0 transparent. */
+pixel_t tms9928a_colour_to_pixel (uint8_t colour);
+
+/* Check a colour, treating non-compatible colours as transparent. */
+uint8_t tms9928a_check_colour (uint8_t colour);
+
+/* Process a single tile, given as tms9928a colours. */
+int32_t tms9928a_process_tile (const uint8_t *colours);
+
+/* Generate the key used to de-duplicate a tile, given as tms9928a colours. */
+void tms9928a_tile_to_key (const uint8_t *colours, uint8_t *key);
+
+/* Generate indices for the file. */
+int tms9928a_process_indices (const char *name, uint16_t *tile_map);
@@ -0,0 +1,98 @@
+/*
+ * Sneptile
+ * Joppy Furr 2024
+ *
+ * Check the planes format against its reference decoder.
+ *
+ * Usage: planes_check <name>_patterns.bin <name>_patterns_planes.bin
+ *
+ * The compressed file is decoded with decoder/planes.c, and compared with the
+ * uncompressed patterns written by --format bin.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../decoder/planes.c"
+
+
+/*
+ * Read a whole file into memory.
+ */
+static uint8_t *read_file (const char *path, size_t *size)
+{
+    FILE *file = fopen (path, "rb");
+    uint8_t *data = NULL;
+    long length;
+
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    if (fseek (file, 0, SEEK_END) == 0 && (length = ftell (file)) >= 0 && fseek (file, 0, SEEK_SET) == 0)
+    {
+        data = malloc (length + 1);
+        if (data != NULL && fread (data, 1, length, file) != (size_t) length)
+        {
+            free (data);
+            data = NULL;
+        }
+        *size = length;
+    }
+
+    fclose (file);
+    return data;
+}
+
+
+int main (int argc, char **argv)
+{
+    size_t patterns_size = 0;
+    size_t planes_size = 0;
+    uint8_t *patterns;
+    uint8_t *planes;
+    uint8_t *decoded;
+
+    if (argc != 3)
+    {
+        fprintf (stderr, "Usage: %s <patterns.bin> <patterns_planes.bin>\n", argv [0]);
+        return EXIT_FAILURE;
+    }
+
+    patterns = read_file (argv [1], &patterns_size);
+    planes = read_file (argv [2], &planes_size);
+    if (patterns == NULL || planes == NULL || planes_size < 2)
+    {
+        fprintf (stderr, "Error: Unable to read %s and %s.\n", argv [1], argv [2]);
+        return EXIT_FAILURE;
+    }
+
+    if ((size_t) (planes [0] | (planes [1] << 8)) * 32 != patterns_size)
+    {
+        fprintf (stderr, "Error: %s has the wrong number of tiles.\n", argv [2]);
+        return EXIT_FAILURE;
+    }
+
+    decoded = malloc (patterns_size);
+    if (decoded == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    planes_decode (planes, decoded);
+
+    if (memcmp (decoded, patterns, patterns_size) != 0)
+    {
+        fprintf (stderr, "Error: %s does not decode to %s.\n", argv [2], argv [1]);
+        return EXIT_FAILURE;
+    }
+
+    free (decoded);
+    free (planes);
+    free (patterns);
+
+    return EXIT_SUCCESS;
+}
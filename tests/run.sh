@@ -0,0 +1,165 @@
+#!/bin/sh
+#
+# Sneptile tests
+#
+# Run from the repository root after building with build.sh:
+#   sh tests/run.sh
+#
+# The test sheets are written as raw sheets, so no image tools are needed.
+#
+
+SNEPTILE=${SNEPTILE:-./Sneptile}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+failures=0
+
+fail ()
+{
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+pass ()
+{
+    echo "pass: $1"
+}
+
+#
+# Write an 8x8 raw sheet with a two-colour palette.
+#   raw_sheet <file> <palette type> <colour 0> <colour 1> <pixel row>
+# The colours are given as octal escapes, and each row of pixels is the same.
+#
+raw_sheet ()
+{
+    printf "SNRW\010\000\010\000\\$2\000\000\001\\$3\\$4" > "$1"
+    for row in 1 2 3 4 5 6 7 8
+    do
+        printf "$5" >> "$1"
+    done
+}
+
+#
+# Run Sneptile with its own output directory, keeping stdout and stderr.
+#   run <test name> <options and sheets>
+#
+run ()
+{
+    out="$WORK/$1"
+    shift
+    mkdir -p "$out"
+    "$SNEPTILE" --output-dir "$out" "$@" > "$out/stdout.txt" 2> "$out/stderr.txt"
+}
+
+
+# Two sheets that share all their tiles: the second adds no patterns, which
+# must not produce an empty array.
+raw_sheet "$WORK/first.raw" 0 000 077 '\000\001\000\001\000\001\000\001'
+raw_sheet "$WORK/second.raw" 0 000 077 '\000\001\000\001\000\001\000\001'
+
+for format in c bin
+do
+    name="shared_tiles_$format"
+    if ! run $name --format $format --dedup-global "$WORK/first.raw" "$WORK/second.raw"
+    then
+        fail "$name: Sneptile failed"
+    elif grep -q "second_patterns \[\]" "$WORK/$name/patterns.h"
+    then
+        fail "$name: Empty patterns array for the second sheet"
+    elif ! grep -q "#define second_patterns_count 0" "$WORK/$name/patterns.h"
+    then
+        fail "$name: Missing patterns count for the second sheet"
+    elif [ -e "$WORK/$name/second_patterns.bin" ]
+    then
+        fail "$name: Empty patterns file for the second sheet"
+    else
+        pass "$name"
+    fi
+done
+
+
+# Raw sheets with colours outside of their palette type are rejected.
+raw_sheet "$WORK/bad_sms.raw" 0 000 100 '\000\001\000\001\000\001\000\001'
+raw_sheet "$WORK/bad_tms.raw" 1 000 020 '\000\001\000\001\000\001\000\001'
+
+for sheet in bad_sms bad_tms
+do
+    name="raw_colour_$sheet"
+    if [ $sheet = bad_tms ]
+    then
+        mode=--mode-2
+    else
+        mode=--sprites
+    fi
+    if run $name $mode "$WORK/$sheet.raw"
+    then
+        fail "$name: Invalid colour accepted"
+    elif ! grep -q "Error: .*$sheet.raw" "$WORK/$name/stderr.txt"
+    then
+        fail "$name: Missing error message"
+    else
+        pass "$name"
+    fi
+done
+
+
+# The compression report gives each sheet's patterns and then its indices,
+# one sheet after another.
+raw_sheet "$WORK/other.raw" 0 000 077 '\001\001\000\000\001\001\000\000'
+name="compression_report"
+if ! run $name --compress zx7 --compress-indices "$WORK/first.raw" "$WORK/other.raw"
+then
+    fail "$name: Sneptile failed"
+elif [ "$(cut -d : -f 1,2 "$WORK/$name/stdout.txt" | cut -d , -f 1 | tr '\n' ' ')" != \
+       "first: 1 patterns first: 1 indices other: 1 patterns other: 1 indices " ]
+then
+    fail "$name: Report is out of order"
+else
+    pass "$name"
+fi
+
+
+# The planes format decodes back to the uncompressed patterns with the reference
+# decoder. The eight tiles use blank, solid, copied, inverted, masked, and raw
+# bitplanes.
+name="planes_round_trip"
+printf "SNRW\100\000\010\000\000\000\000\017" > "$WORK/planes.raw"
+printf "\000\001\002\003\004\005\006\007\010\011\012\013\014\015\016\017" >> "$WORK/planes.raw"
+awk 'BEGIN {
+    srand (1);
+    for (y = 0; y < 8; y++)
+    {
+        for (x = 0; x < 64; x++)
+        {
+            tile = int (x / 8);
+            if (tile == 0)      pixel = 0;
+            else if (tile == 1) pixel = 15;
+            else if (tile == 2) pixel = (rand () < 0.5) ? 0 : 3;
+            else if (tile == 3) pixel = (rand () < 0.5) ? 1 : 2;
+            else if (tile == 4) pixel = (x % 8 == y) ? int (rand () * 16) : 5;
+            else                pixel = int (rand () * 16);
+            printf "%c", pixel;
+        }
+    }
+}' >> "$WORK/planes.raw"
+
+if ! ${CC:-gcc} -std=c11 -o "$WORK/planes_check" tests/planes_check.c
+then
+    fail "$name: Unable to build planes_check"
+elif ! run $name --format bin --compress planes "$WORK/planes.raw"
+then
+    fail "$name: Sneptile failed"
+elif ! "$WORK/planes_check" "$WORK/$name/planes_patterns.bin" "$WORK/$name/planes_patterns_planes.bin"
+then
+    fail "$name: Decoded patterns do not match"
+else
+    pass "$name"
+fi
+
+
+if [ $failures -ne 0 ]
+then
+    echo "$failures test(s) failed."
+    exit 1
+fi
+echo "All tests passed."